@@ -0,0 +1,155 @@
+"""Spectrograms from rffft as numpy arrays, read through librfio.
+
+Arrays returned by read() point into memory owned by the library and are
+freed once no array refers to it any more. Arrays returned by map_file()
+are read-only views of the mapped file. Neither copies the data.
+
+The library is looked up through $RFIO_LIB, next to this directory and
+on the system library path; build it with `make librfio.so`.
+"""
+import ctypes
+import ctypes.util
+import mmap
+import os
+
+import numpy as np
+
+PLANE_MEAN = 0
+PLANE_MAX = 1
+PLANE_VAR = 2
+
+REDUCE_MEAN = 0
+REDUCE_MAX = 1
+REDUCE_MEDIAN = 2
+
+API_VERSION = 1
+
+
+def _load():
+    here = os.path.dirname(os.path.abspath(__file__))
+    names = [os.environ.get('RFIO_LIB'),
+             os.path.join(here, '..', 'librfio.so'),
+             os.path.join(here, '..', 'librfio.dylib'),
+             ctypes.util.find_library('rfio')]
+    for name in names:
+        if name is None:
+            continue
+        try:
+            lib = ctypes.CDLL(name)
+        except OSError:
+            continue
+        if lib.rf_api_version() != API_VERSION:
+            raise OSError('{:s} has API version {:d}, expected {:d}'.format(name, lib.rf_api_version(), API_VERSION))
+        return lib
+    raise OSError('librfio not found, build it with make librfio.so or set RFIO_LIB')
+
+
+_lib = _load()
+_handle = ctypes.c_void_p
+_lib.rf_read.restype = _handle
+_lib.rf_read.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_double,
+                         ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_int]
+_lib.rf_free.argtypes = [_handle]
+for _name, _type in [('rf_nsub', ctypes.c_int), ('rf_nchan', ctypes.c_int),
+                     ('rf_freq', ctypes.c_double), ('rf_samp_rate', ctypes.c_double),
+                     ('rf_start', ctypes.c_char_p),
+                     ('rf_data', ctypes.POINTER(ctypes.c_float)), ('rf_mjd', ctypes.POINTER(ctypes.c_double)),
+                     ('rf_length', ctypes.POINTER(ctypes.c_float)), ('rf_zavg', ctypes.POINTER(ctypes.c_float)),
+                     ('rf_zstd', ctypes.POINTER(ctypes.c_float))]:
+    getattr(_lib, _name).restype = _type
+    getattr(_lib, _name).argtypes = [_handle]
+_lib.rf_map_layout.restype = ctypes.c_int
+_lib.rf_map_layout.argtypes = [ctypes.c_char_p, ctypes.c_int,
+                               ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int),
+                               ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double),
+                               ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]
+_lib.rf_subint_times.restype = ctypes.c_int
+_lib.rf_subint_times.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.c_double),
+                                 ctypes.POINTER(ctypes.c_float), ctypes.c_int]
+
+
+class _Owner:
+    """Frees a library spectrogram once the last array viewing it is gone"""
+    def __init__(self, handle):
+        self.handle = handle
+
+    def __del__(self):
+        _lib.rf_free(self.handle)
+
+
+def _view(owner, ptr, shape):
+    ctype = ptr._type_
+    buf = (ctype * int(np.prod(shape))).from_address(ctypes.addressof(ptr.contents))
+    buf._owner = owner
+    return np.frombuffer(buf, dtype=np.dtype(ctype)).reshape(shape)
+
+
+class Spectrogram:
+    """Spectrogram with power z[subint, channel], mid times mjd, subint
+    lengths in seconds, per subint mean zavg and deviation zstd, centre
+    frequency freq and bandwidth samp_rate in Hz and start time start"""
+    def __init__(self, z, mjd, length, zavg, zstd, freq, samp_rate, start):
+        self.z = z
+        self.mjd = mjd
+        self.length = length
+        self.zavg = zavg
+        self.zstd = zstd
+        self.freq = freq
+        self.samp_rate = samp_rate
+        self.start = start
+
+    @property
+    def nsub(self):
+        return self.z.shape[0]
+
+    @property
+    def nchan(self):
+        return self.z.shape[1]
+
+    def frequencies(self):
+        """Frequencies of the channels in Hz, on the grid of rffft and rfplot"""
+        return self.freq + self.samp_rate * (np.arange(self.nchan) / self.nchan - 0.5)
+
+
+def read(prefix, isub=0, nsub=0, f0=0.0, df0=0.0, nbin=1, fbin=1, reduce=REDUCE_MEAN, foff=0.0, plane=PLANE_MEAN):
+    """Read files prefix_??????.bin from number isub on, taking nsub subints
+    (all while files exist if 0) binned by nbin in time and fbin in
+    frequency, optionally zoomed to bandwidth df0 around f0 (Hz)"""
+    handle = _lib.rf_read(prefix.encode(), isub, nsub, f0, df0, nbin, fbin, reduce, foff, plane)
+    if not handle:
+        raise IOError('Failed to read {:s}_{:06d}.bin'.format(prefix, isub))
+    owner = _Owner(handle)
+    n, m = _lib.rf_nsub(handle), _lib.rf_nchan(handle)
+    return Spectrogram(_view(owner, _lib.rf_data(handle), (n, m)),
+                       _view(owner, _lib.rf_mjd(handle), (n,)),
+                       _view(owner, _lib.rf_length(handle), (n,)),
+                       _view(owner, _lib.rf_zavg(handle), (n,)),
+                       _view(owner, _lib.rf_zstd(handle), (n,)),
+                       _lib.rf_freq(handle), _lib.rf_samp_rate(handle),
+                       _lib.rf_start(handle).decode())
+
+
+def map_file(filename, plane=PLANE_MEAN):
+    """Map a single file of 32 bit float subints without windows; use read()
+    for other files"""
+    nsub, nchan = ctypes.c_int(), ctypes.c_int()
+    freq, samp_rate = ctypes.c_double(), ctypes.c_double()
+    offset, stride = ctypes.c_int64(), ctypes.c_int64()
+    if _lib.rf_map_layout(filename.encode(), plane, nsub, nchan, freq, samp_rate, offset, stride) == 0:
+        raise IOError('{:s} cannot be mapped, use read()'.format(filename))
+
+    with open(filename, 'rb') as f:
+        mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    z = np.ndarray((nsub.value, nchan.value), dtype=np.float32, buffer=mm,
+                   offset=offset.value, strides=(stride.value, 4))
+
+    # Times from the subint headers
+    mjd = np.zeros(nsub.value, dtype=np.float64)
+    length = np.zeros(nsub.value, dtype=np.float32)
+    n = _lib.rf_subint_times(filename.encode(), mjd.ctypes.data_as(ctypes.POINTER(ctypes.c_double)),
+                             length.ctypes.data_as(ctypes.POINTER(ctypes.c_float)), nsub.value)
+    z, mjd, length = z[:n], mjd[:n], length[:n]
+
+    zavg = np.nanmean(z, axis=1) if n > 0 else np.zeros(0, dtype=np.float32)
+    zstd = np.nanstd(z, axis=1) if n > 0 else np.zeros(0, dtype=np.float32)
+    return Spectrogram(z, mjd, length, zavg, zstd, freq.value, samp_rate.value, '')
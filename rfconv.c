@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <stdint.h>
+#include "rftime.h"
+#include "rfio.h"
+
+void usage(void)
+{
+  printf("rfconv: Convert spectrograms with 256 byte headers to indexed files\n\n");
+  printf("-p <prefix>     Input filename prefix\n");
+  printf("-o <prefix>     Output filename prefix\n");
+  printf("-s <start>      Number of starting file [0]\n");
+  printf("-l <number>     Number of files to convert [all]\n");
+  printf("-h              This help\n");
+
+  return;
+}
+
+// Convert a single file, returns number of subints, -1 if absent or -2 on errors
+int convert(char *infname,char *outfname)
+{
+  int i,n=0,status,nchan,nbits,nwin,nplane,nsub=0,nalloc=0,nbyte,error=0;
+  char header[256],*buf=NULL;
+  float zavg,zstd;
+  double freq,samp_rate;
+  int32_t *win=NULL;
+  int64_t *offset=NULL;
+  FILE *infile,*outfile;
+  struct textheader th;
+  struct binheader bh;
+  struct subheader sh;
+
+  // Open files
+  infile=fopen(infname,"r");
+  if (infile==NULL)
+    return -1;
+  outfile=fopen(outfname,"w");
+  if (outfile==NULL) {
+    fprintf(stderr,"Failed to open %s\n",outfname);
+    fclose(infile);
+    return -1;
+  }
+  memset(&th,0,sizeof(struct textheader));
+
+  // Loop over subints
+  for (;;nsub++) {
+    // Read header
+    status=fread(header,sizeof(char),256,infile);
+    if (status!=256)
+      break;
+    if (parse_header(header,&th)==0) {
+      fprintf(stderr,"Failed to parse subint %d of %s\n",nsub,infname);
+      error=1;
+      break;
+    }
+    freq=th.freq;
+    samp_rate=th.samp_rate;
+    nchan=th.nchan;
+    nbits=th.nbits;
+    zavg=th.zavg;
+    zstd=th.zstd;
+    nwin=th.nwin;
+    nplane=th.nplane;
+    if (nwin<0 || nwin>nchan || nplane<1) {
+      fprintf(stderr,"Invalid layout in subint %d of %s\n",nsub,infname);
+      error=1;
+      break;
+    }
+
+    // File header from the first subint
+    if (nsub==0) {
+      bh.freq=freq;
+      bh.samp_rate=samp_rate;
+      bh.nchan=nchan;
+      bh.nbits=nbits;
+      bh.nplane=nplane;
+      bh.nwin=nwin;
+      win=(int32_t *) malloc(sizeof(int32_t)*2*(nwin+1));
+      if (fread(win,sizeof(int32_t),2*nwin,infile)!=2*nwin) {
+	error=1;
+	break;
+      }
+      for (i=0,bh.nstore=(nwin>0) ? 0 : nchan;i<nwin;i++)
+	bh.nstore+=win[2*i+1];
+      nbyte=(nbits==8) ? sizeof(char) : sizeof(float);
+      n=bh.nplane*bh.nstore*nbyte;
+      buf=(char *) malloc(n+2*sizeof(int32_t)*nwin);
+      write_binheader(outfile,&bh,win);
+    } else {
+      // Indexed files have a fixed layout
+      if (nchan!=bh.nchan || nbits!=bh.nbits || nplane!=bh.nplane || nwin!=bh.nwin || fabs(freq-bh.freq)>1e-3 || fabs(samp_rate-bh.samp_rate)>1e-3) {
+	fprintf(stderr,"Layout changes at subint %d of %s\n",nsub,infname);
+	error=1;
+	break;
+      }
+      if (fread(buf,sizeof(int32_t),2*nwin,infile)!=2*nwin || memcmp(buf,win,sizeof(int32_t)*2*nwin)!=0) {
+	fprintf(stderr,"Channel windows change at subint %d of %s\n",nsub,infname);
+	error=1;
+	break;
+      }
+    }
+
+    // Read data
+    if (fread(buf,sizeof(char),n,infile)!=n) {
+      fprintf(stderr,"Truncated subint %d of %s\n",nsub,infname);
+      error=1;
+      break;
+    }
+
+    // Grow index
+    if (nsub>=nalloc) {
+      nalloc=(nalloc==0) ? 64 : 2*nalloc;
+      offset=(int64_t *) realloc(offset,sizeof(int64_t)*nalloc);
+    }
+
+    // Write subint
+    offset[nsub]=ftell(outfile);
+    sh.tns=llround(th.mjd*86400e9);
+    sh.length=th.length;
+    sh.zavg=zavg;
+    sh.zstd=zstd;
+    sh.navg=th.navg;
+    fwrite(&sh,sizeof(struct subheader),1,outfile);
+    fwrite(buf,sizeof(char),n,outfile);
+  }
+
+  // Append index
+  if (nsub>0)
+    write_index(outfile,&bh,offset,nsub);
+
+  // Close files
+  fclose(infile);
+  fclose(outfile);
+
+  // Free
+  free(buf);
+  free(win);
+  free(offset);
+
+  return (error==1) ? -2 : nsub;
+}
+
+int main(int argc,char *argv[])
+{
+  int i,arg=0,isub=0,nfile=-1,nsub;
+  char inprefix[128]="",outprefix[128]="",infname[256],outfname[256];
+
+  // Read arguments
+  if (argc>1) {
+    while ((arg=getopt(argc,argv,"p:o:s:l:h"))!=-1) {
+      switch(arg) {
+
+      case 'p':
+	strcpy(inprefix,optarg);
+	break;
+
+      case 'o':
+	strcpy(outprefix,optarg);
+	break;
+
+      case 's':
+	isub=atoi(optarg);
+	break;
+
+      case 'l':
+	nfile=atoi(optarg);
+	break;
+
+      case 'h':
+	usage();
+	return 0;
+
+      default:
+	usage();
+	return 0;
+      }
+    }
+  } else {
+    usage();
+    return 0;
+  }
+
+  // Same prefix would overwrite the input
+  if (strlen(inprefix)==0 || strlen(outprefix)==0 || strcmp(inprefix,outprefix)==0) {
+    fprintf(stderr,"Distinct input and output prefixes required\n");
+    return -1;
+  }
+
+  // Loop over files
+  for (i=isub;nfile<0 || i<isub+nfile;i++) {
+    sprintf(infname,"%s_%06d.bin",inprefix,i);
+    sprintf(outfname,"%s_%06d.bin",outprefix,i);
+    nsub=convert(infname,outfname);
+    if (nsub==-1)
+      break;
+    if (nsub==-2) {
+      fprintf(stderr,"%s only partially converted\n",infname);
+      continue;
+    }
+    printf("%s -> %s: %d subints\n",infname,outfname,nsub);
+  }
+
+  return 0;
+}
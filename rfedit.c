@@ -1,41 +1,300 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 #include <cpgplot.h>
 #include <getopt.h>
+#include <unistd.h>
 #include "rfio.h"
 
 #define LIM 128
+#define NCHUNK 256 // Subints per chunk
+#define NCOPY 65536 // Bytes per copy where copy_file_range is not available
 
 void dec2sex(double x,char *s,int f,int len);
 
 void usage(void)
 {
-  printf("rfplot: plot RF observations\n\n");
+  printf("rfedit: Cut, bin, split and convert RF observations\n\n");
   printf("-p <path>    Path to file prefix /a/b/c_??????.bin\n");
-  printf("-O <file>    Output file name [test_000000.bin]\n");
-  printf("-s <start>   Number of starting subintegration [0]\n");
-  printf("-l <length>  Number of subintegrations to plot [3600]\n");
+  printf("-O <file>    Output file prefix [test]\n");
+  printf("-s <start>   Number of starting file [0]\n");
+  printf("-l <length>  Number of subintegrations to copy [3600]\n");
+  printf("-n <nsub>    Number of subintegrations per output file [all]\n");
   printf("-o <offset>  Frequency offset to apply (Hz) [0.0]\n");
   printf("-b <nbin>    Number of subintegrations to bin [1]\n");
   printf("-f <freq>    Frequency to zoom into (Hz)\n");
   printf("-w <bw>      Bandwidth to zoom into (Hz)\n");
+  printf("-B <bits>    Output bits per value, 8 or 32 [as input]\n");
+  printf("-V <version> Output format, 1 for 256 byte headers, 2 for indexed files [as input]\n");
   printf("-h           This help\n");
 
   return;
 }
 
+// Copy n bytes between the current positions of two files, in the kernel
+// where possible
+int copy_bytes(FILE *infile,FILE *outfile,long n)
+{
+  int fdin,fdout;
+  long m;
+  ssize_t r=0;
+  off_t in,out;
+  char buf[NCOPY];
+
+  fflush(outfile);
+  fdin=fileno(infile);
+  fdout=fileno(outfile);
+  in=ftell(infile);
+  out=ftell(outfile);
+
+#ifdef __linux__
+  while (n>0) {
+    r=copy_file_range(fdin,&in,fdout,&out,n,0);
+    if (r<=0)
+      break;
+    n-=r;
+  }
+#endif
+
+  // Buffered copy across file systems or without copy_file_range
+  while (n>0) {
+    m=(n<NCOPY) ? n : NCOPY;
+    r=pread(fdin,buf,m,in);
+    if (r<=0 || pwrite(fdout,buf,r,out)!=r)
+      break;
+    in+=r;
+    out+=r;
+    n-=r;
+  }
+
+  // Continue after the copied bytes
+  fseek(infile,in,SEEK_SET);
+  fseek(outfile,out,SEEK_SET);
+
+  return (n==0) ? 0 : -1;
+}
+
+// Version and bits of the first file
+int input_format(char *filename,int *version,int *nbits)
+{
+  char header[256];
+  FILE *file;
+  struct binheader bh;
+  struct textheader th;
+
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return -1;
+  if (read_binheader(file,&bh)==1) {
+    *version=2;
+    *nbits=bh.nbits;
+  } else {
+    memset(&th,0,sizeof(struct textheader));
+    if (fread(header,sizeof(char),256,file)!=256 || parse_header(header,&th)==0) {
+      fclose(file);
+      return -1;
+    }
+    *version=1;
+    *nbits=th.nbits;
+  }
+  fclose(file);
+
+  return 0;
+}
+
+// Output of copied subints
+struct copyout {
+  char *prefix;
+  int version,nper,k,n;
+  FILE *file;
+  struct binheader bh;
+  int32_t *win;
+  int64_t *offset;
+};
+
+// Close the current output file, with the subint count of its headers
+void close_copy(struct copyout *o)
+{
+  if (o->file==NULL)
+    return;
+  if (o->version==2)
+    write_index(o->file,&o->bh,o->offset,o->n);
+  else
+    patch_nsub(o->file,o->offset,o->n);
+  fclose(o->file);
+  o->file=NULL;
+
+  return;
+}
+
+// Start the next output file, with the layout of indexed files
+int next_copy(struct copyout *o,struct binheader *bh,int32_t *win)
+{
+  char filename[300];
+
+  close_copy(o);
+  sprintf(filename,"%s_%06d.bin",o->prefix,o->k++);
+  o->file=fopen(filename,"w+");
+  if (o->file==NULL) {
+    fprintf(stderr,"Failed to open %s\n",filename);
+    return -1;
+  }
+  o->n=0;
+  if (o->version==2) {
+    o->bh=*bh;
+    o->win=(int32_t *) realloc(o->win,sizeof(int32_t)*2*(bh->nwin+1));
+    memcpy(o->win,win,sizeof(int32_t)*2*bh->nwin);
+    write_binheader(o->file,&o->bh,o->win);
+  }
+
+  return 0;
+}
+
+// Copy subints with 256 byte headers, returns the number copied
+int copy_v1(FILE *infile,struct copyout *o,int nsub)
+{
+  int i,l,nbyte,ncopy=0;
+  char header[256];
+  long size,pos;
+  int32_t *win=NULL;
+  struct textheader th;
+
+  memset(&th,0,sizeof(struct textheader));
+  for (;ncopy<nsub;ncopy++) {
+    // Header and channel windows
+    if (fread(header,sizeof(char),256,infile)!=256 || parse_header(header,&th)==0)
+      break;
+    if (th.nwin>0) {
+      win=(int32_t *) realloc(win,sizeof(int32_t)*2*th.nwin);
+      if (fread(win,sizeof(int32_t),2*th.nwin,infile)!=2*th.nwin)
+	break;
+    }
+    nbyte=(th.nbits==8) ? sizeof(char) : sizeof(float);
+    for (i=0,l=(th.nwin>0) ? 0 : th.nchan;i<th.nwin;i++)
+      l+=win[2*i+1];
+    size=(long) th.nplane*l*nbyte;
+
+    // Copy subint
+    if ((o->file==NULL || o->n>=o->nper) && next_copy(o,NULL,NULL)<0)
+      break;
+    pos=ftell(o->file);
+    o->offset[o->n]=pos;
+    fwrite(header,sizeof(char),256,o->file);
+    if (th.nwin>0)
+      fwrite(win,sizeof(int32_t),2*th.nwin,o->file);
+
+    // Drop a truncated last subint
+    if (copy_bytes(infile,o->file,size)<0) {
+      fflush(o->file);
+      if (ftruncate(fileno(o->file),pos)==0)
+	fseek(o->file,pos,SEEK_SET);
+      break;
+    }
+    o->n++;
+  }
+  free(win);
+
+  return ncopy;
+}
+
+// Copy subints of an indexed file, returns the number copied
+int copy_v2(FILE *infile,struct copyout *o,int nsub)
+{
+  int ncopy=0,same;
+  long size;
+  int32_t *win;
+  struct binheader bh;
+
+  // Layout
+  read_binheader(infile,&bh);
+  win=(int32_t *) malloc(sizeof(int32_t)*2*(bh.nwin+1));
+  if (fread(win,sizeof(int32_t),2*bh.nwin,infile)!=2*bh.nwin) {
+    free(win);
+    return 0;
+  }
+  size=sizeof(struct subheader)+(long) bh.nplane*bh.nstore*((bh.nbits==8) ? sizeof(char) : sizeof(float));
+
+  // Files with another layout start a new output file
+  same=(o->file!=NULL && bh.nchan==o->bh.nchan && bh.nbits==o->bh.nbits && bh.nplane==o->bh.nplane && bh.nwin==o->bh.nwin && bh.nstore==o->bh.nstore && bh.freq==o->bh.freq && bh.samp_rate==o->bh.samp_rate && memcmp(win,o->win,sizeof(int32_t)*2*bh.nwin)==0);
+
+  for (;ncopy<nsub && (bh.index==0 || ncopy<bh.nsub);ncopy++,same=1) {
+    if ((same==0 || o->n>=o->nper) && next_copy(o,&bh,win)<0)
+      break;
+
+    // Copy subint header and data, dropping a truncated last subint
+    fseek(infile,subint_offset(infile,&bh,ncopy),SEEK_SET);
+    o->offset[o->n]=ftell(o->file);
+    if (copy_bytes(infile,o->file,size)<0) {
+      fflush(o->file);
+      if (ftruncate(fileno(o->file),o->offset[o->n])==0)
+	fseek(o->file,o->offset[o->n],SEEK_SET);
+      break;
+    }
+    o->n++;
+  }
+  free(win);
+
+  return ncopy;
+}
+
+// Concatenate or split files without decoding, returns the number of
+// subints copied
+int copy_subints(char *prefix,int isub,int nsub,char *outprefix,int nper,int version)
+{
+  int k,m,ncopy=0;
+  char filename[300];
+  FILE *infile;
+  struct binheader bh;
+  struct copyout o;
+
+  memset(&o,0,sizeof(struct copyout));
+  o.prefix=outprefix;
+  o.version=version;
+  o.nper=nper;
+  o.offset=(int64_t *) malloc(sizeof(int64_t)*nper);
+
+  for (k=isub;ncopy<nsub;k++) {
+    // Open input
+    sprintf(filename,"%s_%06d.bin",prefix,k);
+    infile=fopen(filename,"r");
+    if (infile==NULL)
+      break;
+    if (read_binheader(infile,&bh)+1!=version) {
+      fprintf(stderr,"%s has a different format, stopping\n",filename);
+      fclose(infile);
+      break;
+    }
+    rewind(infile);
+
+    // Copy subints
+    m=(version==2) ? copy_v2(infile,&o,nsub-ncopy) : copy_v1(infile,&o,nsub-ncopy);
+    printf("copied %s (%d subints)\n",filename,m);
+    ncopy+=m;
+    fclose(infile);
+  }
+
+  // Close output
+  close_copy(&o);
+  free(o.offset);
+  free(o.win);
+
+  return ncopy;
+}
+
 int main(int argc,char *argv[])
 {
   struct spectrogram s;
-  char path[128],outfile[128]="test";
-  int arg=0,nsub=3600,nbin=1,isub=0;
-  double f0=0.0,df0=0.0,foff=0.0;
+  struct specstream *st;
+  struct specwriter *w;
+  char path[128],outfile[128]="test",filename[256];
+  int arg=0,nsub=3600,nbin=1,isub=0,nper=0,nbits=0,version=0,inversion,inbits,nch,msub,nplane;
+  double f0=0.0,df0=0.0,foff=0.0,bw;
 
   // Read arguments
   if (argc>1) {
-    while ((arg=getopt(argc,argv,"p:o:O:f:w:s:l:b:h"))!=-1) {
+    while ((arg=getopt(argc,argv,"p:o:O:f:w:s:l:n:b:B:V:h"))!=-1) {
       switch (arg) {
 	
       case 'p':
@@ -58,10 +317,26 @@ int main(int argc,char *argv[])
 	nsub=atoi(optarg);
 	break;
 	
+      case 'n':
+	nper=atoi(optarg);
+	break;
+
       case 'b':
 	nbin=atoi(optarg);
 	break;
 	
+      case 'B':
+	nbits=(atoi(optarg)==8) ? 8 : -32;
+	break;
+
+      case 'V':
+	version=atoi(optarg);
+	if (version!=1 && version!=2) {
+	  fprintf(stderr,"Output format version %d not supported\n",version);
+	  return -1;
+	}
+	break;
+
       case 'f':
 	f0=(double) atof(optarg);
 	break;
@@ -84,16 +359,43 @@ int main(int argc,char *argv[])
     return 0;
   }
 
-  // Read data
-  s=read_spectrogram(path,isub,nsub,f0,df0,nbin,foff);
+  // Format of the input, the default for the output
+  sprintf(filename,"%s_%06d.bin",path,isub);
+  if (input_format(filename,&inversion,&inbits)<0) {
+    fprintf(stderr,"Failed to read %s\n",filename);
+    return -1;
+  }
+  if (version==0)
+    version=inversion;
+  if (nbits==0)
+    nbits=inbits;
+  if (nper<=0 || nper>nsub)
+    nper=nsub;
+
+  // Whole subints are copied when they need no decoding
+  if (nbin==1 && f0==0.0 && df0==0.0 && foff==0.0 && version==inversion && nbits==inbits) {
+    copy_subints(path,isub,nsub,outfile,nper,version);
+    return 0;
+  }
+
+  // Decoded subints keep only the mean plane
+  if (read_layout(filename,&nch,&msub,&nplane,&bw)==1 && nplane>1)
+    fprintf(stderr,"Warning: %s has %d planes, only the mean plane is written\n",filename,nplane);
+
+  // Open input
+  st=open_spectrogram(path,isub,nsub,f0,df0,nbin,1,REDUCE_MEAN,foff,PLANE_MEAN,LAYOUT_CHAN,NCHUNK);
+  if (st==NULL)
+    return 0;
 
-  // Write data
-  write_spectrogram(s,outfile);
+  // Copy data in chunks
+  w=open_writer(outfile,nper/nbin>0 ? nper/nbin : 1,nbits,version);
+  while (next_chunk(st,&s)>0)
+    if (write_chunk(w,s)<0)
+      break;
 
-  // Free
-  //  free(s.z);
-  //  free(s.mjd);
-  //  free(s.length);
+  // Close
+  close_writer(w);
+  close_spectrogram(st);
 
   return 0;
 }
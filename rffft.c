@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -5,50 +6,736 @@
 #include <fftw3.h>
 #include <getopt.h>
 #include <time.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <signal.h>
 #include "rftime.h"
+#include "rfnet.h"
+#include "rfio.h"
+
+#define LIM 128
+#define VMAX 8.0 // Maximum LEO radial velocity in km/s
+#define C 299792.458 // Speed of light in km/s
+#define UNIXMJD 3506716800LL // Unix epoch in seconds since MJD 0
+#define HEADROOM 2.0 // Required real-time factor when autotuning
+#define MAXBATCH 4194304 // Maximum number of batched samples when autotuning
+#define ADJUST 16 // Overload adjustments per integration
+#define MAXSKIP 64 // Maximum overload skip factor
+
+// Set on SIGHUP to reread the configuration file
+volatile sig_atomic_t reload=0;
 
 void usage(void)
 {
   printf("rffft: FFT RF observations\n\n");
-  printf("-i <file>       Input file (can be fifo) [stdin]\n");
+  printf("-i <file>       Input file (can be fifo, udp://host:port or tcp://host:port) [stdin]\n");
+  printf("-H <bytes>      Sequence number header size of UDP datagrams [0]\n");
   printf("-p <prefix>     Output prefix\n");
   printf("-f <frequency>  Center frequency (Hz)\n");
   printf("-s <samprate>   Sample rate (Hz)\n");
   printf("-c <chansize>   Channel size [100Hz]\n");
+  printf("-e              Use exact FFT length for channel size [off]\n");
   printf("-t <tint>       Integration time [1s]\n");
   printf("-n <nsub>       Number of integrations per file [60]\n");
   printf("-m <use>        Use every mth integration [1]\n");
   printf("-F <format>     Input format char, int, float [int]\n");
   printf("-T <start time> YYYY-MM-DDTHH:MM:SSS.sss\n");
   printf("-R <fmin,fmax>  Frequency range to store (Hz)\n");
+  printf("-r              Real-valued input samples, -f is frequency at DC [off]\n");
+  printf("-S              Only store channels around frequencies.txt entries [off]\n");
+  printf("-M              Also store maximum and variance planes [off]\n");
+  printf("-z              Also store per-subint statistics as _??????.stats sidecars [off]\n");
+  printf("-D <fraction>   Skip transforms while a fifo, pipe or TCP input queue is fuller\n                than this fraction, recording the averaged spectra as NAVG [off]\n");
+  printf("-C <file>       Configuration file with tint, range and format settings,\n                reread on SIGHUP and applied at the next subint\n");
+  printf("-j <threads>    Number of FFT threads [1]\n");
+  printf("-B <batch>      Number of transforms per FFT batch [1]\n");
+  printf("-P <rigor>      FFT plan rigor estimate, measure, patient [estimate]\n");
+  printf("-A, --autotune  Benchmark thread count, batch size and plan rigor and store\n                the cheapest real-time choice in $ST_DATADIR/data/rffft_<host>.txt\n");
   printf("-b              Digitize output to bytes [off]\n");
+  printf("-V <version>    Output format, 1 for 256 byte headers, 2 for indexed files [1]\n");
   printf("-q              Quiet mode, no output [off]\n");
   printf("-h              This help\n");
 
   return;
 }
 
+// Largest prime factor of n
+int largest_prime_factor(int n)
+{
+  int p,pmax=1;
+
+  for (p=2;p*p<=n;p++) {
+    while (n%p==0) {
+      n/=p;
+      pmax=p;
+    }
+  }
+  if (n>1)
+    pmax=n;
+
+  return pmax;
+}
+
+// Nearest FFT length of the form 2^a 3^b 5^c, optionally even
+int fast_fft_length(int n,int even)
+{
+  int i,m;
+
+  for (i=0;i<n;i++) {
+    // Prefer the longer length on ties for finer channels
+    m=n+i;
+    if (largest_prime_factor(m)<=5 && (even==0 || m%2==0))
+      return m;
+    m=n-i;
+    if (m>1 && largest_prime_factor(m)<=5 && (even==0 || m%2==0))
+      return m;
+  }
+
+  return n;
+}
+
+// Compare channel windows on start channel
+int compare_windows(const void *a,const void *b)
+{
+  return ((int32_t *) a)[0]-((int32_t *) b)[0];
+}
+
+// Channel windows covering the maximum Doppler shift of frequencies.txt entries
+int sparse_windows(double fmin,double fmax,int nchan,int32_t **win)
+{
+  int i,n,nwin,status,satno,j0,j1;
+  char *env,freqlist[LIM],line[LIM];
+  double f,df,dchan;
+  FILE *file;
+  int32_t *w;
+
+  env=getenv("ST_DATADIR");
+  sprintf(freqlist,"%s/data/frequencies.txt",env);
+  file=fopen(freqlist,"r");
+  if (file==NULL) {
+    fprintf(stderr,"%s not found\n",freqlist);
+    return 0;
+  }
+
+  // Count entries
+  for (n=0;fgets(line,LIM,file)!=NULL;n++);
+  rewind(file);
+  w=(int32_t *) malloc(sizeof(int32_t)*2*(n+1));
+
+  // Windows inside the band
+  dchan=(fmax-fmin)/(double) nchan;
+  for (nwin=0;fgets(line,LIM,file)!=NULL;) {
+    status=sscanf(line,"%d %lf",&satno,&f);
+    if (status!=2)
+      continue;
+    f*=1e6;
+    if (f<fmin || f>fmax)
+      continue;
+    df=f*VMAX/C;
+    j0=(int) floor((f-df-fmin)/dchan)-1;
+    j1=(int) ceil((f+df-fmin)/dchan)+1;
+    if (j0<0)
+      j0=0;
+    if (j1>nchan)
+      j1=nchan;
+    w[2*nwin]=j0;
+    w[2*nwin+1]=j1;
+    nwin++;
+  }
+  fclose(file);
+
+  // Merge overlapping windows and store as start, length
+  qsort(w,nwin,2*sizeof(int32_t),compare_windows);
+  for (i=0,n=0;i<nwin;i++) {
+    if (n>0 && w[2*i]<=w[2*(n-1)+1]) {
+      if (w[2*i+1]>w[2*(n-1)+1])
+	w[2*(n-1)+1]=w[2*i+1];
+    } else {
+      w[2*n]=w[2*i];
+      w[2*n+1]=w[2*i+1];
+      n++;
+    }
+  }
+  for (i=0;i<n;i++)
+    w[2*i+1]-=w[2*i];
+  *win=w;
+
+  return n;
+}
+
+// Channel range and windows of the output band
+int output_channels(double freqmin,double freqmax,double fcen,double bw,int nchan,int sparse,int *imin,int *imax,int *partial,int *nout,int *ioff,int32_t **win,int *nwin,int *nstore)
+{
+  int i,i0=0,i1=nchan,n=0,nw=0;
+  int32_t *w=NULL;
+
+  // Get channel range
+  if (freqmin>0.0 && freqmax>0.0) {
+    i0=(int) ((freqmin-fcen+0.5*bw)*(double) nchan/bw);
+    i1=(int) ((freqmax-fcen+0.5*bw)*(double) nchan/bw);
+    if (i0<0 || i0>=nchan || i1<0 || i1>=nchan || i1<=i0) {
+      fprintf(stderr,"Output frequency range (%.3lf MHz -> %.3lf MHz) incompatible with\ninput settings (%.3lf MHz center frequency, %.3lf MHz bandwidth)!\n",freqmin*1e-6,freqmax*1e-6,fcen*1e-6,bw*1e-6);
+      return -1;
+    }
+  } else {
+    freqmin=fcen-0.5*bw;
+    freqmax=fcen+0.5*bw;
+  }
+
+  // Get channel windows
+  if (sparse==1) {
+    nw=sparse_windows(freqmin,freqmax,i1-i0,&w);
+    if (nw==0) {
+      fprintf(stderr,"No frequencies.txt entries inside the output band!\n");
+      free(w);
+      return -1;
+    }
+    for (i=0;i<nw;i++)
+      n+=w[2*i+1];
+  }
+
+  // Output channels
+  *partial=(i0>0 || i1<nchan);
+  *imin=i0;
+  *imax=i1;
+  *nout=i1-i0;
+  *ioff=i0;
+  if (*nwin>0)
+    free(*win);
+  *win=w;
+  *nwin=nw;
+  *nstore=n;
+
+  return 0;
+}
+
+// Output settings from a configuration file, only keys present are changed
+int read_config(char *fname,double *tint,double *freqmin,double *freqmax,char *outformat)
+{
+  int status=0;
+  char line[LIM],key[LIM],value[LIM];
+  FILE *file;
+
+  file=fopen(fname,"r");
+  if (file==NULL) {
+    fprintf(stderr,"%s not found\n",fname);
+    return -1;
+  }
+  while (fgets(line,LIM,file)!=NULL) {
+    if (line[0]=='#' || sscanf(line,"%s %s",key,value)!=2)
+      continue;
+    if (strcmp(key,"tint")==0) {
+      *tint=atof(value);
+    } else if (strcmp(key,"range")==0) {
+      if (strcmp(value,"full")==0) {
+	*freqmin=-1;
+	*freqmax=-1;
+      } else if (sscanf(value,"%lf,%lf",freqmin,freqmax)!=2) {
+	status=-1;
+      }
+    } else if (strcmp(key,"format")==0) {
+      if (strcmp(value,"float")==0)
+	*outformat='f';
+      else if (strcmp(value,"char")==0)
+	*outformat='c';
+      else
+	status=-1;
+    } else {
+      status=-1;
+    }
+    if (status<0) {
+      fprintf(stderr,"Failed to parse %s: %s",fname,line);
+      break;
+    }
+  }
+  fclose(file);
+
+  return status;
+}
+
+// Request rereading the configuration file
+void hangup(int sig)
+{
+  reload=1;
+
+  return;
+}
+
+// Read count values of size bytes from file or network stream
+size_t read_input(FILE *file,struct netstream *ns,void *buf,size_t size,size_t count)
+{
+  if (ns->fd>=0)
+    return read_netstream(ns,buf,size,count);
+
+  return fread(buf,size,count,file);
+}
+
+// Add keyword line before END if the header stays within 256 bytes
+int add_keyword(char *header,char *line)
+{
+  if (strlen(header)+strlen(line)>255)
+    return -1;
+  strcpy(header+strlen(header)-4,line);
+  strcat(header,"END\n");
+
+  return 0;
+}
+
+// Center frequency and bandwidth of the stored channels, on the channel grid
+void header_band(int partial,int imin,int imax,double fcen,double bw,int nchan,double *hfreq,double *hbw)
+{
+  if (partial==1) {
+    *hbw=(imax-imin)*bw/(double) nchan;
+    *hfreq=fcen-0.5*bw+0.5*(imin+imax)*bw/(double) nchan;
+  } else {
+    *hbw=bw;
+    *hfreq=fcen;
+  }
+
+  return;
+}
+
+// Format a 256 byte header with the window and plane counts that describe
+// the data layout and the averaged spectra if navg>=0, dropping decimals of
+// the 8 bit mean and rms, which need no more than 4 digits, and then of the
+// length where they would not fit; returns the decimals of the length kept,
+// -1 if the counts do not fit
+int format_header(char *header,char *nfd,double freq,double bw,double length,int nchan,int nsub,char outformat,float zavg,float zstd,int nwin,int nplane,int navg)
+{
+  int prec,edig,status;
+  char line[LIM];
+
+  for (prec=6;prec>=0;prec--) {
+    for (edig=6;edig>=((outformat=='c') ? 3 : 6);edig--) {
+      if (outformat=='c')
+	sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %.*f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %.*e\nRMS          %.*e\nEND\n",nfd,freq,bw,prec,length,nchan,nsub,edig,zavg,edig,zstd);
+      else
+	sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %.*f s\nNCHAN        %d\nNSUB         %d\nEND\n",nfd,freq,bw,prec,length,nchan,nsub);
+      status=(strlen(header)>255) ? -1 : 0;
+      if (status==0 && nwin>0) {
+	sprintf(line,"NWIN         %d\n",nwin);
+	status=add_keyword(header,line);
+      }
+      if (status==0 && nplane>1) {
+	sprintf(line,"NPLANE       %d\n",nplane);
+	status=add_keyword(header,line);
+      }
+      if (status==0 && navg>=0) {
+	sprintf(line,"NAVG         %d\n",navg);
+	status=add_keyword(header,line);
+      }
+      if (status==0)
+	return prec;
+    }
+  }
+
+  return -1;
+}
+
+// Whether headers of subints of length tint keep full precision with the
+// widest mean and rms values, which are not negative for powers, and at
+// most navg averaged spectra
+int header_fits(double freq,double bw,double tint,int nchan,int nsub,char outformat,int nwin,int nplane,int navg)
+{
+  char header[512];
+
+  return (format_header(header,"2000-01-01T00:00:00.000",freq,bw,tint,nchan,nsub,outformat,1e38,1e38,nwin,nplane,navg)==6);
+}
+
+// Output channels as the readers decode them into zq, filling channels
+// outside the windows with the mean of the stored ones; zs holds nout values
+void decode_output(float *z,char *cz,int nout,int ioff,int nwin,int32_t *win,char outformat,float zavg,float zstd,float *zq,float *zs)
+{
+  int i,j,n;
+  double s1;
+
+  // Dense subints
+  if (nwin==0) {
+    for (j=0;j<nout;j++)
+      zq[j]=(outformat=='c') ? 6.0/256.0*(float) cz[ioff+j]*zstd+zavg : z[ioff+j];
+    return;
+  }
+
+  // Stored channels
+  for (i=0,n=0;i<nwin;i++)
+    for (j=0;j<win[2*i+1];j++,n++)
+      zs[n]=(outformat=='c') ? 6.0/256.0*(float) cz[ioff+win[2*i]+j]*zstd+zavg : z[ioff+win[2*i]+j];
+
+  // Expand
+  for (j=0,s1=0.0;j<n;j++)
+    s1+=zs[j];
+  s1/=(double) n;
+  for (j=0;j<nout;j++)
+    zq[j]=s1;
+  for (i=0,n=0;i<nwin;i++)
+    for (j=0;j<win[2*i+1];j++,n++)
+      zq[win[2*i]+j]=zs[n];
+
+  return;
+}
+
+// Fill fraction of a fifo, pipe or socket input queue, -1 for other inputs
+double queue_fill(int fd)
+{
+  int n,size=0;
+  socklen_t len=sizeof(size);
+  struct stat st;
+
+  if (fd<0 || fstat(fd,&st)<0)
+    return -1.0;
+  if (S_ISFIFO(st.st_mode)) {
+#ifdef F_GETPIPE_SZ
+    size=fcntl(fd,F_GETPIPE_SZ);
+#else
+    size=65536;
+#endif
+  } else if (S_ISSOCK(st.st_mode)) {
+    getsockopt(fd,SOL_SOCKET,SO_RCVBUF,&size,&len);
+  }
+  if (size<=0 || ioctl(fd,FIONREAD,&n)<0)
+    return -1.0;
+
+  return (double) n/(double) size;
+}
+
+// Plan rigor names and FFTW flags
+char *rigor_name[]={"estimate","measure","patient"};
+unsigned rigor_flag[]={FFTW_ESTIMATE,FFTW_MEASURE,FFTW_PATIENT};
+
+// Index of plan rigor name, -1 if unknown
+int plan_rigor(char *name)
+{
+  int i;
+
+  for (i=0;i<3;i++)
+    if (strcmp(name,rigor_name[i])==0)
+      return i;
+
+  return -1;
+}
+
+// Plan a batch of nbatch transforms stored nfft values apart
+fftwf_plan plan_batch(int nfft,int nbatch,int real,fftwf_complex *c,float *rin,fftwf_complex *d,int nthreads,int rigor)
+{
+  int n[1];
+
+  n[0]=nfft;
+  fftwf_plan_with_nthreads(nthreads);
+  if (real==0)
+    return fftwf_plan_many_dft(1,n,nbatch,c,NULL,1,nfft,d,NULL,1,nfft,FFTW_FORWARD,rigor_flag[rigor]);
+  else
+    return fftwf_plan_many_dft_r2c(1,n,nbatch,rin,NULL,1,nfft,d,NULL,1,nfft/2+1,rigor_flag[rigor]);
+}
+
+// Unpack and window one buffer of samples
+void unpack(char *buf,char informat,int real,int nfft,float *zw,fftwf_complex *c,float *rin)
+{
+  int i;
+  int16_t *ibuf=(int16_t *) buf;
+  float *fbuf=(float *) buf;
+
+  if (real==1) {
+    if (informat=='i') {
+      for (i=0;i<nfft;i++)
+	rin[i]=(float) ibuf[i]/32768.0*zw[i];
+    } else if (informat=='c') {
+      for (i=0;i<nfft;i++)
+	rin[i]=(float) buf[i]/256.0*zw[i];
+    } else if (informat=='f') {
+      for (i=0;i<nfft;i++)
+	rin[i]=fbuf[i]*zw[i];
+    }
+  } else if (informat=='i') {
+    for (i=0;i<nfft;i++) {
+      c[i][0]=(float) ibuf[2*i]/32768.0*zw[i];
+      c[i][1]=(float) ibuf[2*i+1]/32768.0*zw[i];
+    } 
+  } else if (informat=='c') {
+    for (i=0;i<nfft;i++) {
+      c[i][0]=(float) buf[2*i]/256.0*zw[i];
+      c[i][1]=(float) buf[2*i+1]/256.0*zw[i];
+    } 
+  } else if (informat=='f') {
+    for (i=0;i<nfft;i++) {
+      c[i][0]=fbuf[2*i]*zw[i];
+      c[i][1]=fbuf[2*i+1]*zw[i];
+    } 
+  }
+
+  return;
+}
+
+// Add powers of nb transforms, dist values apart, to the spectrum and planes
+void add_spectra(fftwf_complex *d,int nb,int dist,int nchan,int real,int planes,float *z,float *zm,double *zs2)
+{
+  int i,k,l;
+  float pw;
+
+  for (k=0;k<nb;k++,d+=dist) {
+    for (i=0;i<nchan;i++) {
+      if (real==1)
+	l=i;
+      else if (i<nchan/2)
+	l=i+nchan/2;
+      else
+	l=i-nchan/2;
+      
+      pw=d[i][0]*d[i][0]+d[i][1]*d[i][1];
+      z[l]+=pw;
+      if (planes==1) {
+	if (pw>zm[l])
+	  zm[l]=pw;
+	zs2[l]+=pw*pw;
+      }
+    }
+  }
+
+  return;
+}
+
+// Transforms per second for a configuration on synthetic noise
+double benchmark(int nfft,int nchan,int real,char informat,int planes,float *zw,int nthreads,int nbatch,int rigor)
+{
+  int i,k,n,nvalue,nsize;
+  char *buf;
+  fftwf_complex *c,*d;
+  float *rin,*z,*zm;
+  double *zs2,t;
+  fftwf_plan fft;
+  struct timeval start,end;
+
+  // Allocate
+  nvalue=(real==1) ? nfft : 2*nfft;
+  nsize=(informat=='c') ? sizeof(char) : ((informat=='i') ? sizeof(int16_t) : sizeof(float));
+  buf=(char *) malloc(nsize*nvalue*nbatch);
+  c=fftwf_malloc(sizeof(fftwf_complex)*nfft*nbatch);
+  d=fftwf_malloc(sizeof(fftwf_complex)*nfft*nbatch);
+  rin=fftwf_malloc(sizeof(float)*nfft*nbatch);
+  z=(float *) calloc(nchan,sizeof(float));
+  zm=(float *) calloc(nchan,sizeof(float));
+  zs2=(double *) calloc(nchan,sizeof(double));
+
+  // Plan before filling, measuring overwrites the arrays
+  fft=plan_batch(nfft,nbatch,real,c,rin,d,nthreads,rigor);
+
+  // Synthetic noise
+  for (i=0;i<nsize*nvalue*nbatch;i++)
+    buf[i]=rand()%256-128;
+  if (informat=='f')
+    for (i=0;i<nvalue*nbatch;i++)
+      ((float *) buf)[i]=(float) (rand()%256-128)/256.0;
+
+  // Run for at least 0.2s
+  gettimeofday(&start,0);
+  for (n=0,t=0.0;t<0.2;) {
+    for (k=0;k<nbatch;k++)
+      unpack(buf+k*nvalue*nsize,informat,real,nfft,zw,c+k*nfft,rin+k*nfft);
+    fftwf_execute(fft);
+    add_spectra(d,nbatch,(real==1) ? nfft/2+1 : nfft,nchan,real,planes,z,zm,zs2);
+    n+=nbatch;
+    gettimeofday(&end,0);
+    t=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6;
+  }
+
+  // Free
+  fftwf_destroy_plan(fft);
+  free(buf);
+  fftwf_free(c);
+  fftwf_free(d);
+  fftwf_free(rin);
+  free(z);
+  free(zm);
+  free(zs2);
+
+  return (double) n/t;
+}
+
+// Per host profile or wisdom file name
+void profile_name(char *fname,char *ext)
+{
+  char *env,host[64]="";
+
+  gethostname(host,sizeof(host)-1);
+  env=getenv("ST_DATADIR");
+  sprintf(fname,"%s/data/rffft_%s.%s",env,host,ext);
+
+  return;
+}
+
+// Sample rates of profile entries, allowing for rounding when stored
+int same_rate(double s,double samp_rate)
+{
+  return fabs(s-samp_rate)<=1e-9*fabs(samp_rate);
+}
+
+// Look up tuned settings, returns 1 if found
+int read_profile(int nfft,double samp_rate,int real,char informat,int *nthreads,int *nbatch,int *rigor)
+{
+  int n,r,nt,nb,status,found=0;
+  double s;
+  char fname[LIM],line[LIM],f,name[16];
+  FILE *file;
+
+  profile_name(fname,"txt");
+  file=fopen(fname,"r");
+  if (file==NULL)
+    return 0;
+  while (fgets(line,LIM,file)!=NULL) {
+    status=sscanf(line,"%d %lf %d %c %d %d %15s",&n,&s,&r,&f,&nt,&nb,name);
+    if (status!=7 || n!=nfft || same_rate(s,samp_rate)==0 || r!=real || f!=informat || plan_rigor(name)<0)
+      continue;
+    *nthreads=nt;
+    *nbatch=nb;
+    *rigor=plan_rigor(name);
+    found=1;
+  }
+  fclose(file);
+
+  return found;
+}
+
+// Store tuned settings, replacing an earlier entry for the same input
+void write_profile(int nfft,double samp_rate,int real,char informat,int nthreads,int nbatch,int rigor)
+{
+  int n,r,status,nline;
+  double s;
+  char fname[LIM],line[LIM],f,*lines=NULL;
+  FILE *file;
+
+  // Keep other entries
+  profile_name(fname,"txt");
+  file=fopen(fname,"r");
+  for (nline=0;file!=NULL && fgets(line,LIM,file)!=NULL;) {
+    status=sscanf(line,"%d %lf %d %c",&n,&s,&r,&f);
+    if (status==4 && n==nfft && same_rate(s,samp_rate)==1 && r==real && f==informat)
+      continue;
+    lines=(char *) realloc(lines,LIM*(nline+1));
+    strcpy(lines+LIM*nline,line);
+    nline++;
+  }
+  if (file!=NULL)
+    fclose(file);
+
+  // Rewrite
+  file=fopen(fname,"w");
+  if (file==NULL) {
+    fprintf(stderr,"Failed to write profile %s\n",fname);
+    free(lines);
+    return;
+  }
+  for (n=0;n<nline;n++)
+    fputs(lines+LIM*n,file);
+  fprintf(file,"%d %.17g %d %c %d %d %s\n",nfft,samp_rate,real,informat,nthreads,nbatch,rigor_name[rigor]);
+  fclose(file);
+  free(lines);
+  printf("Stored settings in %s\n",fname);
+
+  return;
+}
+
+// Cheapest configuration keeping real-time headroom for rate transforms per second
+void autotune(int nfft,int nchan,int real,char informat,int planes,float *zw,double rate,int *nthreads,int *nbatch,int *rigor)
+{
+  int i,j,r,r0,r1,ncpu,nt,nb,nthread=0,nbatches=4,bt=1,bb=1,br=0,ok=0;
+  int threads[16],batches[]={1,4,16,64};
+  double speed,cost,bcost=0.0,bspeed=0.0;
+
+  // Thread counts up to the number of processors
+  ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+  if (*nthreads>0)
+    threads[nthread++]=*nthreads;
+  else
+    for (nt=1;nt<=ncpu && nthread<16;nt*=2)
+      threads[nthread++]=nt;
+  if (nthread==0)
+    threads[nthread++]=1;
+
+  // Batch sizes
+  if (*nbatch>0) {
+    batches[0]=*nbatch;
+    nbatches=1;
+  }
+
+  // Patient planning takes too long to benchmark
+  r0=(*rigor>=0) ? *rigor : 0;
+  r1=(*rigor>=0) ? *rigor : 1;
+
+  printf("Autotuning for %.1f transforms/s\n",rate);
+  printf("threads batch rigor    transforms/s realtime\n");
+  for (i=0;i<nthread;i++) {
+    nt=threads[i];
+    for (j=0;j<nbatches;j++) {
+      nb=batches[j];
+      // Keep batches within memory
+      if (*nbatch<=0 && nb>1 && (long) nb*nfft>MAXBATCH)
+	continue;
+      for (r=r0;r<=r1;r++) {
+	speed=benchmark(nfft,nchan,real,informat,planes,zw,nt,nb,r);
+	cost=(double) nt/speed;
+	printf("%7d %5d %-8s %12.1f %8.2f\n",nt,nb,rigor_name[r],speed,speed/rate);
+
+	// Cheapest with headroom, else fastest
+	if (speed>=HEADROOM*rate) {
+	  if (ok==0 || cost<bcost) {
+	    bt=nt;
+	    bb=nb;
+	    br=r;
+	    bcost=cost;
+	  }
+	  ok=1;
+	} else if (ok==0 && speed>bspeed) {
+	  bt=nt;
+	  bb=nb;
+	  br=r;
+	}
+	if (speed>bspeed)
+	  bspeed=speed;
+      }
+    }
+  }
+  if (ok==0)
+    fprintf(stderr,"Warning: no configuration keeps %.0fx real-time headroom, using the fastest\n",HEADROOM);
+
+  *nthreads=bt;
+  *nbatch=bb;
+  *rigor=br;
+
+  return;
+}
+
 int main(int argc,char *argv[])
 {
-  int i,j,k,l,m,nchan,nint=1,arg=0,nbytes,nsub=60,flag,nuse=1,realtime=1,quiet=0,imin,imax,partial=0;
+  int i,j,k,l,m,nchan,nfft,nvalue,nint=1,arg=0,nbytes,nsub=60,flag,nuse=1,realtime=1,quiet=0,imin,imax,partial=0,real=0,exact=0,nfast,sparse=0,nwin=0,nstore,nout,ioff,planes=0,nplane=1,navg,stats=0;
+  int newimin,newimax,newpartial,newnout,newioff,newnwin,newnstore;
+  int32_t *win,*newwin;
+  int nhdr=0,version=1,nwritten,layout,qfd=-1,nskip=1,nused,jadj,nsize,nread,nb,b,dist,nthreads=0,nbatch=0,rigor=-1,tune=0;
+  struct netstream ns;
+  struct binheader bh;
+  struct subheader sh;
+  struct substats ss;
+  int64_t *offset;
   fftwf_complex *c,*d;
+  float *rin;
   fftwf_plan fft;
-  FILE *infile,*outfile;
-  char infname[128]="",outfname[128]="",path[64]=".",prefix[32]="";
-  char informat='i',outformat='f';
-  int16_t *ibuf;
-  char *cbuf;
-  float *fbuf;
-  float *z,length,fchan=100.0,tint=1.0,zavg,zstd,*zw;
+  FILE *infile,*outfile,*statfile=NULL;
+  char infname[128]="",outfname[128]="",statfname[128]="",path[64]=".",prefix[32]="";
+  char informat='i',outformat='f',wisdom[LIM],config[LIM]="",newformat;
+  char *buf;
+  float *z,length,zavg,zstd,*zw,*zm,*zv,*zp[3],zscale,*zq,*zt;
   char *cz;
-  double freq,samp_rate,mjd,freqmin=-1,freqmax=-1;
+  double freq,samp_rate,fchan=100.0,tint=1.0,newtint,mjd,freqmin=-1,freqmax=-1,fcen,bw,hfreq,hbw,newfreq,newbw,*zs2,watermark=0.0,fill,newmin,newmax,tstart=0.0;
   struct timeval start,end;
-  char tbuf[30],nfd[32],header[256]="";
+  char tbuf[30],nfd[32],header[512]="";
+  struct option options[]={{"autotune",no_argument,NULL,'A'},{NULL,0,NULL,0}};
 
   // Read arguments
   if (argc>1) {
-    while ((arg=getopt(argc,argv,"i:f:s:c:t:p:n:hm:F:T:bqR:"))!=-1) {
+    while ((arg=getopt_long(argc,argv,"i:f:s:c:t:p:n:hm:F:T:bqR:reSMH:j:B:P:AD:C:V:z",options,NULL))!=-1) {
       switch(arg) {
 	
       case 'i':
@@ -88,6 +775,67 @@ int main(int argc,char *argv[])
 	outformat='c';
 	break;
 
+      case 'r':
+	real=1;
+	break;
+
+      case 'e':
+	exact=1;
+	break;
+
+      case 'S':
+	sparse=1;
+	break;
+
+      case 'M':
+	planes=1;
+	nplane=3;
+	break;
+
+      case 'z':
+	stats=1;
+	break;
+
+      case 'H':
+	nhdr=atoi(optarg);
+	break;
+
+      case 'j':
+	nthreads=atoi(optarg);
+	break;
+
+      case 'B':
+	nbatch=atoi(optarg);
+	break;
+
+      case 'P':
+	rigor=plan_rigor(optarg);
+	if (rigor<0) {
+	  fprintf(stderr,"Unknown plan rigor %s\n",optarg);
+	  return -1;
+	}
+	break;
+
+      case 'A':
+	tune=1;
+	break;
+
+      case 'D':
+	watermark=atof(optarg);
+	break;
+
+      case 'C':
+	strcpy(config,optarg);
+	break;
+
+      case 'V':
+	version=atoi(optarg);
+	if (version!=1 && version!=2) {
+	  fprintf(stderr,"Output format version %d not supported\n",version);
+	  return -1;
+	}
+	break;
+
       case 'n':
 	nsub=atoi(optarg);
 	break;
@@ -123,54 +871,133 @@ int main(int argc,char *argv[])
     return 0;
   }
 
+  // FFT length
+  if (real==0)
+    nfft=(int) (samp_rate/fchan);
+  else
+    nfft=2*(int) (0.5*samp_rate/fchan);
+
+  // Avoid slow transforms with large prime factors
+  nfast=fast_fft_length(nfft,real);
+  if (exact==0) {
+    nfft=nfast;
+  } else if (nfast!=nfft) {
+    fprintf(stderr,"Warning: FFT length %d has a prime factor of %d and will be considerably slower than\nthe nearby length %d (%.3f Hz channels); omit -e to use it.\n",nfft,largest_prime_factor(nfft),nfast,samp_rate/(double) nfast);
+  }
+  
+  // Exact channel size
+  fchan=samp_rate/(double) nfft;
+
+  // Initial settings from the configuration file
+  if (strlen(config)>0) {
+    if (read_config(config,&tint,&freqmin,&freqmax,&outformat)<0)
+      return -1;
+    signal(SIGHUP,hangup);
+  }
+
   // Ensure integer number of spectra per subintegration
   tint=ceil(fchan*tint)/fchan;
   
   // Number of channels
-  nchan=(int) (samp_rate/fchan);
+  if (real==0) {
+    nchan=nfft;
+    fcen=freq;
+    bw=samp_rate;
+  } else {
+    // Real samples only cover DC to the Nyquist frequency
+    nchan=nfft/2;
+    fcen=freq+0.25*samp_rate;
+    bw=0.5*samp_rate;
+  }
 
   // Number of integrations
-  nint=(int) (tint*(float) samp_rate/(float) nchan);
+  nint=(int) lround(tint*samp_rate/(double) nfft);
 
-  // Get channel range
-  if (freqmin>0.0 && freqmax>0.0) {
-    imin=(int) ((freqmin-freq+0.5*samp_rate)/fchan);
-    imax=(int) ((freqmax-freq+0.5*samp_rate)/fchan);
-    if (imin<0 || imin>=nchan || imax<0 || imax>=nchan || imax<=imin) {
-      fprintf(stderr,"Output frequency range (%.3lf MHz -> %.3lf MHz) incompatible with\ninput settings (%.3lf MHz center frequency, %.3lf MHz sample rate)!\n",freqmin*1e-6,freqmax*1e-6,freq*1e-6,samp_rate*1e-6);
-      return -1;
-    }
-    partial=1;
+  // Extra planes are not digitized
+  if (planes==1 && outformat=='c') {
+    fprintf(stderr,"Maximum and variance planes require 32 bit output!\n");
+    return -1;
+  }
+
+  // Output channels
+  if (output_channels(freqmin,freqmax,fcen,bw,nchan,sparse,&imin,&imax,&partial,&nout,&ioff,&win,&nwin,&nstore)<0)
+    return -1;
+
+  // Layout keywords have to fit the 256 byte headers
+  header_band(partial,imin,imax,fcen,bw,nchan,&hfreq,&hbw);
+  if (version==1 && header_fits(hfreq,hbw,tint,nout,nsub,outformat,nwin,nplane,(watermark>0.0) ? nint : -1)==0) {
+    fprintf(stderr,"Channel windows, planes and averaged spectra do not fit 256 byte headers, use -V 2\n");
+    return -1;
   }
   
   // Dump statistics
   printf("Filename: %s\n", (strlen(infname) ? infname : "stdin"));
-  printf("Frequency: %f MHz\n",freq*1e-6);
-  printf("Bandwidth: %f MHz\n",samp_rate*1e-6);
+  printf("Input samples: %s\n",(real==1) ? "real" : "complex");
+  printf("Frequency: %f MHz\n",fcen*1e-6);
+  printf("Bandwidth: %f MHz\n",bw*1e-6);
   printf("Sampling time: %f us\n",1e6/samp_rate);
+  printf("FFT length: %d\n",nfft);
   printf("Number of channels: %d\n",nchan);
-  printf("Channel size: %f Hz\n",samp_rate/(float) nchan);
+  printf("Channel size: %f Hz\n",samp_rate/(float) nfft);
   printf("Integration time: %f s\n",tint);
   printf("Number of averaged spectra: %d\n",nint);
   printf("Number of subints per file: %d\n",nsub);
+  if (planes==1)
+    printf("Stored planes: mean, maximum, variance\n");
+  if (nwin>0)
+    printf("Stored channels: %d of %d in %d windows\n",nstore,nout,nwin);
+
+  // Window
+  zw=(float *) malloc(sizeof(float)*nfft);
+  for (i=0;i<nfft;i++)
+    zw[i]=0.54-0.46*cos(2.0*M_PI*i/(nfft-1));
+
+  // Threads, batch size and plan rigor from autotuning or an earlier profile
+  fftwf_init_threads();
+  if (tune==1) {
+    autotune(nfft,nchan,real,informat,planes,zw,samp_rate/(double) nfft/(double) nuse,&nthreads,&nbatch,&rigor);
+    write_profile(nfft,samp_rate,real,informat,nthreads,nbatch,rigor);
+  } else if (nthreads==0 && nbatch==0 && rigor<0) {
+    if (read_profile(nfft,samp_rate,real,informat,&nthreads,&nbatch,&rigor)==1)
+      printf("Using tuned settings for this host\n");
+  }
+  if (nthreads<=0)
+    nthreads=1;
+  if (nbatch<=0)
+    nbatch=1;
+  if (rigor<0)
+    rigor=0;
+  printf("FFT threads: %d, batch: %d, plan: %s\n",nthreads,nbatch,rigor_name[rigor]);
+
+  // Number of values to read per transform
+  nvalue=(real==1) ? nfft : 2*nfft;
+  nsize=(informat=='c') ? sizeof(char) : ((informat=='i') ? sizeof(int16_t) : sizeof(float));
 
   // Allocate
-  c=fftwf_malloc(sizeof(fftwf_complex)*nchan);
-  d=fftwf_malloc(sizeof(fftwf_complex)*nchan);
-  ibuf=(int16_t *) malloc(sizeof(int16_t)*2*nchan);
-  cbuf=(char *) malloc(sizeof(char)*2*nchan);
-  fbuf=(float *) malloc(sizeof(float)*2*nchan);
+  c=fftwf_malloc(sizeof(fftwf_complex)*nfft*nbatch);
+  d=fftwf_malloc(sizeof(fftwf_complex)*nfft*nbatch);
+  rin=fftwf_malloc(sizeof(float)*nfft*nbatch);
+  buf=(char *) malloc(nsize*nvalue*nbatch);
   z=(float *) malloc(sizeof(float)*nchan);
+  zm=(float *) malloc(sizeof(float)*nchan);
+  zv=(float *) malloc(sizeof(float)*nchan);
+  zs2=(double *) malloc(sizeof(double)*nchan);
+  zp[0]=z;
+  zp[1]=zm;
+  zp[2]=zv;
   cz=(char *) malloc(sizeof(char)*nchan);
-  zw=(float *) malloc(sizeof(float)*nchan);
+  zq=(float *) malloc(sizeof(float)*nchan);
+  zt=(float *) malloc(sizeof(float)*nchan);
+  offset=(int64_t *) malloc(sizeof(int64_t)*nsub);
 
-  // Compute window
-  for (i=0;i<nchan;i++)
-    zw[i]=0.54-0.46*cos(2.0*M_PI*i/(nchan-1));
-  
-
-  // Plan
-  fft=fftwf_plan_dft_1d(nchan,c,d,FFTW_FORWARD,FFTW_ESTIMATE);
+  // Plan, reusing wisdom of earlier measured plans
+  profile_name(wisdom,"wisdom");
+  if (rigor>0)
+    fftwf_import_wisdom_from_filename(wisdom);
+  fft=plan_batch(nfft,nbatch,real,c,rin,d,nthreads,rigor);
+  if (rigor>0)
+    fftwf_export_wisdom_to_filename(wisdom);
+  dist=(real==1) ? nfft/2+1 : nfft;
 
   // Create prefix
   if (realtime==1) {
@@ -182,87 +1009,193 @@ int main(int argc,char *argv[])
   }
   
   // Open file
-  if (strlen(infname)) {
+  ns.fd=-1;
+  infile=NULL;
+  if (is_netstream(infname)) {
+    if (open_netstream(&ns,infname,nhdr)<0)
+      return -1;
+  } else if (strlen(infname)) {
       infile = fopen(infname, "r");
   } else {
       infile = stdin;
   }
 
+  // Input queue to watch for overload, UDP queues only hold whole datagrams
+  if (watermark>0.0) {
+    if (ns.fd>=0 && ns.type==SOCK_STREAM)
+      qfd=ns.fd;
+    else if (infile!=NULL)
+      qfd=fileno(infile);
+#ifdef F_SETPIPE_SZ
+    // Enlarge pipe to absorb short load peaks
+    fcntl(qfd,F_SETPIPE_SZ,1048576);
+#endif
+    if (queue_fill(qfd)<0.0) {
+      fprintf(stderr,"Warning: -D only applies to fifo, pipe or TCP input\n");
+      watermark=0.0;
+    }
+  }
+
   // Forever loop
   for (m=0;;m++) {
     // File name
     sprintf(outfname,"%s/%s_%06d.bin",path,prefix,m);
-    outfile=fopen(outfname,"w");
+    outfile=fopen(outfname,"w+");
+    nwritten=0;
+    if (stats==1) {
+      sprintf(statfname,"%s/%s_%06d.stats",path,prefix,m);
+      statfile=fopen(statfname,"w");
+    }
 
     // Loop over subints to dump
     for (k=0;k<nsub;k++) {
+      // Apply new settings, starting a new file if the channel layout changes
+      if (reload==1) {
+	reload=0;
+	newtint=tint;
+	newmin=freqmin;
+	newmax=freqmax;
+	newformat=outformat;
+	if (read_config(config,&newtint,&newmin,&newmax,&newformat)==0) {
+	  if (planes==1 && newformat=='c') {
+	    fprintf(stderr,"Maximum and variance planes require 32 bit output, keeping settings\n");
+	  } else {
+	    newnwin=0;
+	    newwin=NULL;
+	    if (output_channels(newmin,newmax,fcen,bw,nchan,sparse,&newimin,&newimax,&newpartial,&newnout,&newioff,&newwin,&newnwin,&newnstore)==0) {
+	      header_band(newpartial,newimin,newimax,fcen,bw,nchan,&newfreq,&newbw);
+	      newtint=ceil(fchan*newtint)/fchan;
+	      if (version==1 && header_fits(newfreq,newbw,newtint,newnout,nsub,newformat,newnwin,nplane,(watermark>0.0) ? (int) lround(newtint*samp_rate/(double) nfft) : -1)==0) {
+		fprintf(stderr,"Channel windows and averaged spectra do not fit 256 byte headers, keeping settings\n");
+		if (newnwin>0)
+		  free(newwin);
+	      } else {
+		// Frequencies.txt may have changed the windows
+		layout=(newmin!=freqmin || newmax!=freqmax || newformat!=outformat || newnwin!=nwin || (nwin>0 && memcmp(newwin,win,sizeof(int32_t)*2*nwin)!=0));
+		if (nwin>0)
+		  free(win);
+		win=newwin;
+		nwin=newnwin;
+		nstore=newnstore;
+		imin=newimin;
+		imax=newimax;
+		partial=newpartial;
+		nout=newnout;
+		ioff=newioff;
+		hfreq=newfreq;
+		hbw=newbw;
+		tint=newtint;
+		nint=(int) lround(tint*samp_rate/(double) nfft);
+		freqmin=newmin;
+		freqmax=newmax;
+		outformat=newformat;
+		fprintf(stderr,"Reconfigured: %f s integrations, %d channels from %d, %s output\n",tint,nout,ioff,(outformat=='c') ? "char" : "float");
+		if (layout==1 && k>0)
+		  break;
+	      }
+	    }
+	  }
+	}
+      }
+
       // Initialize
-      for (i=0;i<nchan;i++) 
+      for (i=0;i<nchan;i++) {
 	z[i]=0.0;
+	zm[i]=0.0;
+	zs2[i]=0.0;
+      }
+      navg=0;
+      nused=0;
+      jadj=0;
       
       // Log start time
       gettimeofday(&start,0);
       
       // Integrate
-      for (j=0;j<nint;j++) {
-	// Read buffer
-	if (informat=='i')
-	  nbytes=fread(ibuf,sizeof(int16_t),2*nchan,infile);
-	else if (informat=='c')
-	  nbytes=fread(cbuf,sizeof(char),2*nchan,infile);
-	else if (informat=='f')
-	  nbytes=fread(fbuf,sizeof(float),2*nchan,infile);
-
-	// End on empty buffer
-	if (nbytes==0)
-	  break;
+      for (j=0,nb=0;j<nint;) {
+	// Read up to a batch of buffers
+	nread=(nint-j<nbatch) ? nint-j : nbatch;
+	nbytes=read_input(infile,&ns,buf,nsize,nread*nvalue);
+
+	// Use arrival time of the first datagram
+	if (j==0 && ns.fd>=0)
+	  start=ns.tv;
 
-	// Skip buffer
-	if (j%nuse!=0)
-	  continue;
-
-	// Unpack 
-	if (informat=='i') {
-	  for (i=0;i<nchan;i++) {
-	    c[i][0]=(float) ibuf[2*i]/32768.0*zw[i];
-	    c[i][1]=(float) ibuf[2*i+1]/32768.0*zw[i];
-	  } 
-	} else if (informat=='c') {
-	  for (i=0;i<nchan;i++) {
-	    c[i][0]=(float) cbuf[2*i]/256.0*zw[i];
-	    c[i][1]=(float) cbuf[2*i+1]/256.0*zw[i];
-	  } 
-	} else if (informat=='f') {
-	  for (i=0;i<nchan;i++) {
-	    c[i][0]=(float) fbuf[2*i]*zw[i];
-	    c[i][1]=(float) fbuf[2*i+1]*zw[i];
-	  } 
+	// Double skip factor above the watermark, halve it below half of it
+	if (watermark>0.0 && (j==0 || j-jadj>=nint/ADJUST)) {
+	  fill=queue_fill(qfd);
+	  jadj=j;
+	  if (fill>watermark && nskip<MAXSKIP) {
+	    if (nskip==1)
+	      fprintf(stderr,"Input queue %.0f%% full, skipping transforms\n",100.0*fill);
+	    nskip*=2;
+	  } else if (fill<0.5*watermark && nskip>1) {
+	    nskip/=2;
+	    if (nskip==1)
+	      fprintf(stderr,"Input queue recovered\n");
+	  }
 	}
-	  
-	// Execute
-	fftwf_execute(fft);
-	
-	// Add
-	for (i=0;i<nchan;i++) {
-	  if (i<nchan/2)
-	    l=i+nchan/2;
-	  else
-	    l=i-nchan/2;
-	  
-	  //z[l]+=sqrt(d[i][0]*d[i][0]+d[i][1]*d[i][1]);
-	  z[l]+=d[i][0]*d[i][0]+d[i][1]*d[i][1];
+
+	// Unpack complete buffers into the batch
+	for (b=0;b<nbytes/nvalue;b++,j++) {
+	  // Skip buffer
+	  if (j%nuse!=0)
+	    continue;
+
+	  // Skip under overload, keeping the first of each subint
+	  nused++;
+	  if ((nused-1)%nskip!=0)
+	    continue;
+
+	  unpack(buf+b*nvalue*nsize,informat,real,nfft,zw,c+nb*nfft,rin+nb*nfft);
+	  nb++;
+
+	  // Execute and add full batch
+	  if (nb==nbatch) {
+	    fftwf_execute(fft);
+	    add_spectra(d,nb,dist,nchan,real,planes,z,zm,zs2);
+	    navg+=nb;
+	    nb=0;
+	  }
+	}
+
+	// End on short buffer
+	if (nbytes<nread*nvalue) {
+	  nbytes=0;
+	  break;
 	}
       }
 
+      // Add partial batch, unused slots are transformed but ignored
+      if (nb>0) {
+	fftwf_execute(fft);
+	add_spectra(d,nb,dist,nchan,real,planes,z,zm,zs2);
+	navg+=nb;
+      }
+
       // Log end time
       gettimeofday(&end,0);
 
       // Time stats
       length=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6;
       
-      // Scale
+      // Scale planes to the units of the mean
+      if (planes==1 && navg>0) {
+	zscale=(float) nused*(float) nuse/(float) nfft;
+	for (i=0;i<nchan;i++) {
+	  zv[i]=(zs2[i]/(double) navg-(double) z[i]*z[i]/((double) navg*navg))*zscale*zscale;
+	  zm[i]*=zscale;
+	}
+      } else if (planes==1) {
+	// No spectra, like the mean and the reset maximum
+	for (i=0;i<nchan;i++)
+	  zv[i]=0.0;
+      }
+
+      // Scale, correcting for skipped transforms
+      zscale=(navg>0) ? (float) nused/(float) navg : 1.0;
       for (i=0;i<nchan;i++) 
-	z[i]*=(float) nuse/(float) nchan;
+	z[i]*=zscale*(float) nuse/(float) nfft;
       
       // Scale to bytes
       if (outformat=='c') {
@@ -291,30 +1224,58 @@ int main(int argc,char *argv[])
       if (realtime==1) {
 	strftime(tbuf,30,"%Y-%m-%dT%T",gmtime(&start.tv_sec));
 	sprintf(nfd,"%s.%03ld",tbuf,start.tv_usec/1000);
+	sh.tns=((int64_t) start.tv_sec+UNIXMJD)*1000000000LL+(int64_t) start.tv_usec*1000LL;
       } else {
-	mjd2nfd(mjd+(m*nsub+k)*tint/86400.0,nfd); 
+	mjd2nfd(mjd+tstart/86400.0,nfd); 
+	sh.tns=llround((mjd*86400.0+tstart)*1e9);
 	length=tint;
+	tstart+=tint;
       }
 
-      // Header
-      if (partial==0) {
-	if (outformat=='f') 
-	  sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nEND\n",nfd,freq,samp_rate,length,nchan,nsub);
-	else if (outformat=='c')
-	  sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %e\nRMS          %e\nEND\n",nfd,freq,samp_rate,length,nchan,nsub,zavg,zstd);
-      } else if (partial==1) {
-	if (outformat=='f') 
-	  sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nEND\n",nfd,0.5*(freqmax+freqmin),freqmax-freqmin,length,imax-imin,nsub);
-	else if (outformat=='c')
-	  sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %e\nRMS          %e\nEND\n",nfd,0.5*(freqmax+freqmin),freqmax-freqmin,length,imax-imin,nsub,zavg,zstd);
+      // Header, with fewer decimals of the length after a stall
+      if (version==1 && format_header(header,nfd,hfreq,hbw,length,nout,nsub,outformat,zavg,zstd,nwin,nplane,(watermark>0.0) ? navg : -1)<0) {
+	fprintf(stderr,"Header too long for a %f s subint, stopping\n",length);
+	nbytes=0;
+	break;
       }
+
       // Limit output
       if (!quiet)
 	printf("%s %s %f %d\n",outfname,nfd,length,j);
       
       // Dump file
-      fwrite(header,sizeof(char),256,outfile);
-      if (partial==0) {
+      if (version==2) {
+	// File header with the layout, subint header with time and scaling
+	if (nwritten==0) {
+	  bh.freq=hfreq;
+	  bh.samp_rate=hbw;
+	  bh.nchan=nout;
+	  bh.nbits=(outformat=='c') ? 8 : -32;
+	  bh.nplane=nplane;
+	  bh.nwin=nwin;
+	  bh.nstore=(nwin>0) ? nstore : nout;
+	  write_binheader(outfile,&bh,win);
+	}
+	offset[nwritten]=ftell(outfile);
+	sh.length=length;
+	sh.zavg=(outformat=='c') ? zavg : 0.0;
+	sh.zstd=(outformat=='c') ? zstd : 0.0;
+	sh.navg=navg;
+	fwrite(&sh,sizeof(struct subheader),1,outfile);
+      } else {
+	offset[nwritten]=ftell(outfile);
+	fwrite(header,sizeof(char),256,outfile);
+	if (nwin>0)
+	  fwrite(win,sizeof(int32_t),2*nwin,outfile);
+      }
+      if (nwin>0) {
+	for (i=0;i<nwin;i++) {
+	  if (outformat=='f')
+	    fwrite(&z[ioff+win[2*i]],sizeof(float),win[2*i+1],outfile);
+	  else if (outformat=='c')
+	    fwrite(&cz[ioff+win[2*i]],sizeof(char),win[2*i+1],outfile);
+	}
+      } else if (partial==0) {
 	if (outformat=='f')
 	  fwrite(z,sizeof(float),nchan,outfile);
 	else if (outformat=='c')
@@ -325,30 +1286,74 @@ int main(int argc,char *argv[])
 	else if (outformat=='c')
 	  fwrite(&cz[imin],sizeof(char),imax-imin,outfile);
       }
+
+      // Dump maximum and variance planes
+      for (l=1;l<nplane;l++) {
+	if (nwin>0) {
+	  for (i=0;i<nwin;i++)
+	    fwrite(&zp[l][ioff+win[2*i]],sizeof(float),win[2*i+1],outfile);
+	} else {
+	  fwrite(&zp[l][ioff],sizeof(float),nout,outfile);
+	}
+      }
+      nwritten++;
+
+      // Statistics of the stored channels as they will be decoded
+      if (statfile!=NULL) {
+	decode_output(z,cz,nout,ioff,nwin,win,outformat,zavg,zstd,zq,zt);
+	subint_stats(zq,nout,&ss,zt);
+	fwrite(&ss,sizeof(struct substats),1,statfile);
+      }
+
       // Break;
       if (nbytes==0)
 	break;
     }
 
+    // Append index, or correct NSUB of a file ended early
+    if (version==2)
+      write_index(outfile,&bh,offset,nwritten);
+    else if (nwritten<nsub)
+      patch_nsub(outfile,offset,nwritten);
+
+    // Close file
+    fclose(outfile);
+    if (statfile!=NULL)
+      fclose(statfile);
+
     // Break;
     if (nbytes==0)
       break;
-    
-    // Close file
-    fclose(outfile);
   }
-  fclose(infile);
+  if (ns.fd>=0) {
+    if (ns.npacket>0)
+      printf("Received %ld datagrams, %ld sequence gaps, %ld datagrams lost\n",ns.npacket,ns.ngap,ns.nlost);
+    close_netstream(&ns);
+  } else {
+    fclose(infile);
+  }
 
   // Destroy plan
   fftwf_destroy_plan(fft);
 
+  fftwf_cleanup_threads();
+
   // Deallocate
-  free(ibuf);
+  free(buf);
   fftwf_free(c);
   fftwf_free(d);
+  fftwf_free(rin);
   free(z);
+  free(zm);
+  free(zv);
+  free(zs2);
   free(cz);
+  free(zq);
+  free(zt);
   free(zw);
+  free(offset);
+  if (nwin>0)
+    free(win);
   
   return 0;
 }
@@ -3,106 +3,197 @@
 #include <stdlib.h>
 #include <math.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "rftime.h"
 #include "rfio.h"
 
 #define LIM 128
 #define NMAX 64
+#define NCHUNK 256 // Subints per chunk
+#define NBLOCK 16 // Subints handed to a filtering thread at once
+#define NTHREAD 8 // Filtering threads
 
 
 
-void filter(struct spectrogram s,int site_id,float sigma,char *filename,int graves)
+// Output of a block of subints, written in order once all are filtered
+struct block {
+  char *buf;
+  long n,nalloc;
+};
+
+// Chunk shared by the filtering threads
+struct filterjob {
+  struct spectrogram *s;
+  struct block *b;
+  int site_id,graves,nblock,next;
+  float sigma;
+  pthread_mutex_t lock;
+};
+
+// Append a line to a block
+void append_line(struct block *b,char *line)
+{
+  int n=strlen(line);
+
+  if (b->n+n>b->nalloc) {
+    b->nalloc=(b->nalloc==0) ? 4096 : 2*b->nalloc;
+    if (b->nalloc<b->n+n)
+      b->nalloc=b->n+n;
+    b->buf=(char *) realloc(b->buf,b->nalloc);
+  }
+  memcpy(b->buf+b->n,line,n);
+  b->n+=n;
+
+  return;
+}
+
+// Mark the peaks of subint i above sigma; mask has room for mask[-1]
+void filter_subint(struct spectrogram *s,int i,float sigma,int site_id,int graves,int *mask,float *sig,float *buf,struct block *b)
 {
-  int i,j,k,l;
+  int j,k,l;
   float s1,s2,avg,std,dz;
-  FILE *file;
   double f;
-  int *mask;
-  float *sig;
+  float *z;
+  char line[LIM];
 
-  mask=(int *) malloc(sizeof(int)*s.nchan);
-  sig=(float *) malloc(sizeof(float)*s.nchan);
-  
-  // Open file
-  file=fopen(filename,"a");
+  // Channels of this subint
+  z=subint_span(s,i,buf);
 
-  // Loop over subints
-  for (i=0;i<s.nsub;i++) {
-    // Set mask
-    for (j=0;j<s.nchan;j++)
-      mask[j]=1;
+  // Set mask
+  for (j=0;j<s->nchan;j++)
+    mask[j]=1;
 
-    // Iterate to remove outliers
-    for (k=0;k<10;k++) {
+  // Iterate to remove outliers
+  for (k=0;k<10;k++) {
 
-      // Find average
-      for (j=0,s1=s2=0.0;j<s.nchan;j++) {
-	if (mask[j]==1) {
-	  s1+=s.z[i+s.nsub*j];
-	  s2+=1.0;
-	}
+    // Find average
+    for (j=0,s1=s2=0.0;j<s->nchan;j++) {
+      if (mask[j]==1) {
+	s1+=z[j];
+	s2+=1.0;
       }
-      avg=s1/s2;
+    }
+    avg=s1/s2;
       
-      // Find standard deviation
-      for (j=0,s1=s2=0.0;j<s.nchan;j++) {
-	if (mask[j]==1) {
-	  dz=s.z[i+s.nsub*j]-avg;
-	  s1+=dz*dz;
-	  s2+=1.0;
-	}
-      }
-      std=sqrt(s1/s2);
-
-      // Update mask
-      for (j=0,l=0;j<s.nchan;j++) {
-	if (fabs(s.z[i+s.nsub*j]-avg)>sigma*std) {
-	  mask[j]=0;
-	  l++;
-	}
+    // Find standard deviation
+    for (j=0,s1=s2=0.0;j<s->nchan;j++) {
+      if (mask[j]==1) {
+	dz=z[j]-avg;
+	s1+=dz*dz;
+	s2+=1.0;
       }
     }
-       // Reset mask
-    for (j=0;j<s.nchan;j++) {
-      sig[j]=(s.z[i+s.nsub*j]-avg)/std;
-      if (sig[j]>sigma) 
-	mask[j]=1;
-      else
-	mask[j]=0;
-    }    
+    std=sqrt(s1/s2);
 
-    // Find maximum when points are adjacent
-    for (j=0;j<s.nchan-1;j++) {
-      if (mask[j]==1 && mask[j+1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j+1)])
-	  mask[j]=0;
+    // Update mask
+    for (j=0,l=0;j<s->nchan;j++) {
+      if (fabs(z[j]-avg)>sigma*std) {
+	mask[j]=0;
+	l++;
       }
     }
-    for (j=s.nchan-2;j>=0;j--) {
-      if (mask[j]==1 && mask[j-1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j-1)])
-	  mask[j]=0;
-      }
+  }
+  // Reset mask
+  for (j=0;j<s->nchan;j++) {
+    sig[j]=(z[j]-avg)/std;
+    if (sig[j]>sigma) 
+      mask[j]=1;
+    else
+      mask[j]=0;
+  }    
+
+  // Find maximum when points are adjacent
+  for (j=0;j<s->nchan-1;j++) {
+    if (mask[j]==1 && mask[j+1]==1) {
+      if (z[j]<z[j+1])
+	mask[j]=0;
     }
+  }
+  for (j=s->nchan-2;j>=0;j--) {
+    if (mask[j]==1 && mask[j-1]==1) {
+      if (z[j]<z[j-1])
+	mask[j]=0;
+    }
+  }
 
-    // Mark points
-    for (j=0;j<s.nchan;j++) {
-      if (mask[j]==1) {
-	f=s.freq-0.5*s.samp_rate+(double) j*s.samp_rate/(double) s.nchan;
-	if (s.mjd[i]>1.0) {
-	  if (graves==0)
-	    fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,sig[j],site_id);
-	  else
-	    fprintf(file,"%lf %lf %f %d 9999\n",s.mjd[i],f,sig[j],site_id);
-	}
+  // Mark points
+  for (j=0;j<s->nchan;j++) {
+    if (mask[j]==1) {
+      f=s->freq-0.5*s->samp_rate+(double) j*s->samp_rate/(double) s->nchan;
+      if (s->mjd[i]>1.0) {
+	if (graves==0)
+	  snprintf(line,LIM,"%lf %lf %f %d\n",s->mjd[i],f,sig[j],site_id);
+	else
+	  snprintf(line,LIM,"%lf %lf %f %d 9999\n",s->mjd[i],f,sig[j],site_id);
+	append_line(b,line);
       }
     }
-  } 
+  }
 
-  fclose(file);
+  return;
+}
+
+void *filter_thread(void *arg)
+{
+  int i,k;
+  int *mask;
+  float *sig,*buf;
+  struct filterjob *job=(struct filterjob *) arg;
+  struct spectrogram *s=job->s;
+
+  mask=(int *) calloc(s->nchan+1,sizeof(int));
+  sig=(float *) malloc(sizeof(float)*s->nchan);
+  buf=(float *) malloc(sizeof(float)*s->nchan);
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    k=job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (k>=job->nblock)
+      break;
+    for (i=k*NBLOCK;i<s->nsub && i<(k+1)*NBLOCK;i++)
+      filter_subint(s,i,job->sigma,job->site_id,job->graves,mask+1,sig,buf,&job->b[k]);
+  }
 
   free(mask);
   free(sig);
+  free(buf);
+
+  return NULL;
+}
+
+// Filter the subints of a chunk in parallel, appending peaks to file in
+// time order
+void filter(struct spectrogram s,int site_id,float sigma,FILE *file,int graves)
+{
+  int i,nthread;
+  struct filterjob job;
+  pthread_t thread[NTHREAD];
+
+  job.s=&s;
+  job.site_id=site_id;
+  job.graves=graves;
+  job.sigma=sigma;
+  job.nblock=(s.nsub+NBLOCK-1)/NBLOCK;
+  job.next=0;
+  job.b=(struct block *) calloc(job.nblock,sizeof(struct block));
+  pthread_mutex_init(&job.lock,NULL);
+
+  // Blocks are handed out as threads become free
+  nthread=(job.nblock<NTHREAD) ? job.nblock : NTHREAD;
+  for (i=0;i<nthread;i++)
+    pthread_create(&thread[i],NULL,filter_thread,&job);
+  for (i=0;i<nthread;i++)
+    pthread_join(thread[i],NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  // Write blocks in order
+  for (i=0;i<job.nblock;i++) {
+    fwrite(job.b[i].buf,sizeof(char),job.b[i].n,file);
+    free(job.b[i].buf);
+  }
+  fflush(file);
+  free(job.b);
 
   return;
 }
@@ -120,6 +211,8 @@ void usage(void)
   printf("-c <catalog> TLE catalog\n");
   printf("-g           GRAVES data\n");
   printf("-S           Sigma limit [default: 5.0]\n");
+  printf("-P <plane>   Plane to read: 0 mean, 1 maximum, 2 variance [0]\n");
+  printf("-F           Follow files as they are written\n");
   printf("-h           This help\n");
 }
 
@@ -127,10 +220,11 @@ int main(int argc,char *argv[])
 {
   int i,j,k,l,j0,j1,m=2,n;
   struct spectrogram s;
+  struct specstream *st;
   char path[128];
   int isub=0,nsub=0;
   char *env;
-  int site_id=0,graves=0;
+  int site_id=0,graves=0,plane=PLANE_MEAN,follow=0;
   float avg,std;
   int arg=0;
   float sigma=5.0;
@@ -148,7 +242,7 @@ int main(int argc,char *argv[])
 
   // Read arguments
   if (argc>1) {
-    while ((arg=getopt(argc,argv,"p:f:w:s:l:hc:o:S:g"))!=-1) {
+    while ((arg=getopt(argc,argv,"p:f:w:s:l:hc:o:S:gP:F"))!=-1) {
       switch (arg) {
 	
       case 'p':
@@ -174,6 +268,14 @@ int main(int argc,char *argv[])
       case 'g':
 	graves=1;
 	break;
+
+      case 'P':
+	plane=atoi(optarg);
+	break;
+
+      case 'F':
+	follow=1;
+	break;
 	
       case 'S':
 	sigma=atof(optarg);
@@ -197,39 +299,28 @@ int main(int argc,char *argv[])
     return 0;
   }
 
-  if (nsub==0) {
-    // Read data
-    for (i=isub;;i++) {
-      s=read_spectrogram(path,i,nsub,f0,df0,1,0.0);
-
-      // Exit on emtpy file
-      if (s.nsub==0)
-	break;
-      
-      printf("Read spectrogram\n%d channels, %d subints\nFrequency: %g MHz\nBandwidth: %g MHz\n",s.nchan,s.nsub,s.freq*1e-6,s.samp_rate*1e-6);
-    
-      // Filter
-      filter(s,site_id,sigma,filename,graves);
-    }
-  } else {
-    // Read data
-    s=read_spectrogram(path,isub,nsub,f0,df0,1,0.0);
-
-    // Exit on emtpy file
-    if (s.nsub>0) {
-      printf("Read spectrogram\n%d channels, %d subints\nFrequency: %g MHz\nBandwidth: %g MHz\n",s.nchan,s.nsub,s.freq*1e-6,s.samp_rate*1e-6);
-      
-      // Filter
-      filter(s,site_id,sigma,filename,graves);
-    }
+  // Read data in chunks, all files if no length is given
+  if (follow==1)
+    st=follow_spectrogram(path,isub,f0,df0,1,1,REDUCE_MEAN,0.0,plane,LAYOUT_CHAN,NCHUNK);
+  else
+    st=open_spectrogram(path,isub,nsub,f0,df0,1,1,REDUCE_MEAN,0.0,plane,LAYOUT_CHAN,NCHUNK);
+  if (st==NULL)
+    return 0;
+  file=fopen(filename,"a");
+  if (file==NULL) {
+    fprintf(stderr,"Failed to open %s\n",filename);
+    close_spectrogram(st);
+    return -1;
   }
+  for (i=0;next_chunk(st,&s)>0;i++) {
+    if (i==0)
+      printf("Read spectrogram\n%d channels\nFrequency: %g MHz\nBandwidth: %g MHz\n",s.nchan,s.freq*1e-6,s.samp_rate*1e-6);
 
-  // Free
-  free(s.z);
-  free(s.mjd);
-  //  free(s.zavg);
-  //  free(s.zstd);
-  //  free(s.length);
+    // Filter
+    filter(s,site_id,sigma,file,graves);
+  }
+  fclose(file);
+  close_spectrogram(st);
 
   return 0;
 }
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "rfio.h"
+
+#define NTHREAD 8 // Threads sampling file headers
+
+void usage(void)
+{
+  printf("rfindex: Index spectrograms of an archive\n\n");
+  printf("Usage: rfindex [-i <index>] <directory> ...\n\n");
+  printf("-i <index>      Index file [%s]\n",INDEX_NAME);
+  printf("-f              Rebuild, sampling every file again\n");
+  printf("-h              This help\n\n");
+  printf("Directories are scanned recursively. Files already in the index\n");
+  printf("with the same size and modification time are not read again.\n");
+
+  return;
+}
+
+// Copy an unchanged index entry to a file
+void reuse_entry(struct indexentry *e,struct fileinfo *f)
+{
+  f->status=(e->version>0);
+  f->version=e->version;
+  f->nsub=e->nsub;
+  f->nchan=e->nchan;
+  f->nbits=e->nbits;
+  f->nplane=e->nplane;
+  f->truncated=e->truncated;
+  f->freq=e->freq;
+  f->samp_rate=e->samp_rate;
+  f->mjd0=e->mjd0;
+  f->mjd1=e->mjd1;
+  f->length=e->length;
+
+  return;
+}
+
+// Whether prefix lies in one of the scanned directories
+int in_scan(char *prefix,char **dirs,int ndir)
+{
+  int i,m;
+
+  for (i=0;i<ndir;i++) {
+    m=strlen(dirs[i]);
+    if (strncmp(prefix,dirs[i],m)==0 && (prefix[m]=='/' || dirs[i][m-1]=='/'))
+      return 1;
+  }
+
+  return 0;
+}
+
+// Entry of file f in the old index, or NULL
+struct indexentry *find_entry(struct archive *a,struct fileinfo *f)
+{
+  int lo,hi,mid,status;
+
+  for (lo=0,hi=a->nfile-1;lo<=hi;) {
+    mid=(lo+hi)/2;
+    status=strncmp(a->prefix[a->e[mid].series],f->name,f->base);
+    if (status==0 && a->prefix[a->e[mid].series][f->base]!='\0')
+      status=1;
+    if (status==0)
+      status=a->e[mid].k-f->k;
+    if (status==0)
+      return &a->e[mid];
+    if (status<0)
+      lo=mid+1;
+    else
+      hi=mid-1;
+  }
+
+  return NULL;
+}
+
+int main(int argc,char *argv[])
+{
+  int i,j,arg=0,n=0,nalloc=0,nsample,nreuse=0,nfound=0,nkeep=0,ndir=0,rebuild=0;
+  char indexname[1024]=INDEX_NAME,dir[PATH_MAX],**dirs;
+  struct fileinfo *f=NULL;
+  struct indexentry *e;
+  struct archive old,a;
+  struct stat st;
+
+  // Read arguments
+  while ((arg=getopt(argc,argv,"i:fh"))!=-1) {
+    switch (arg) {
+
+    case 'i':
+      strcpy(indexname,optarg);
+      break;
+
+    case 'f':
+      rebuild=1;
+      break;
+
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 0;
+    }
+  }
+  if (optind>=argc) {
+    usage();
+    return 0;
+  }
+
+  // Previous index
+  if (rebuild==0 && read_archive(indexname,&old)==0 && stat(indexname,&st)==0) {
+    fprintf(stderr,"%s is not an index, use -f to replace it\n",indexname);
+    return -1;
+  } else if (rebuild==1) {
+    memset(&old,0,sizeof(struct archive));
+  }
+
+  // Scan directories with absolute paths, so queries work from anywhere
+  dirs=(char **) malloc(sizeof(char *)*argc);
+  for (i=optind;i<argc;i++) {
+    if (realpath(argv[i],dir)==NULL || stat(dir,&st)!=0 || !S_ISDIR(st.st_mode)) {
+      fprintf(stderr,"%s is not a directory\n",argv[i]);
+      continue;
+    }
+    scan_directory(dir,NULL,1,&f,&n,&nalloc);
+    dirs[ndir++]=strdup(dir);
+  }
+  qsort(f,n,sizeof(struct fileinfo),compare_files);
+
+  // Directories listed more than once
+  for (i=1,j=(n>0);i<n;i++) {
+    if (strcmp(f[i].name,f[j-1].name)==0) {
+      free(f[i].name);
+      continue;
+    }
+    f[j++]=f[i];
+  }
+  n=j;
+
+  // Reuse unchanged entries
+  for (i=0;i<n;i++) {
+    e=find_entry(&old,&f[i]);
+    if (e==NULL)
+      continue;
+    nfound++;
+    if (e->size!=f[i].size || e->mtime!=f[i].mtime)
+      continue;
+    reuse_entry(e,&f[i]);
+    nreuse++;
+  }
+
+  // Keep entries outside the scanned directories
+  for (i=0;i<old.nfile;i++) {
+    if (in_scan(old.prefix[old.e[i].series],dirs,ndir)==1)
+      continue;
+    if (n>=nalloc) {
+      nalloc=(nalloc==0) ? 1024 : 2*nalloc;
+      f=(struct fileinfo *) realloc(f,sizeof(struct fileinfo)*nalloc);
+    }
+    memset(&f[n],0,sizeof(struct fileinfo));
+    snprintf(dir,sizeof(dir),"%s_%06d.bin",old.prefix[old.e[i].series],old.e[i].k);
+    f[n].name=strdup(dir);
+    f[n].base=strlen(dir)-11;
+    f[n].k=old.e[i].k;
+    f[n].size=old.e[i].size;
+    f[n].mtime=old.e[i].mtime;
+    reuse_entry(&old.e[i],&f[n]);
+    n++;
+    nkeep++;
+  }
+  qsort(f,n,sizeof(struct fileinfo),compare_files);
+
+  // Sample new and changed files in parallel
+  nsample=sample_files(f,n,NTHREAD);
+
+  // Series prefixes, pointing into the file names
+  a.nseries=0;
+  a.nfile=n;
+  a.names=NULL;
+  a.prefix=(char **) malloc(sizeof(char *)*(n+1));
+  a.e=(struct indexentry *) malloc(sizeof(struct indexentry)*(n+1));
+  for (i=0;i<n;i++) {
+    if (i==0 || f[i].base!=f[i-1].base || strncmp(f[i].name,f[i-1].name,f[i].base)!=0)
+      a.prefix[a.nseries++]=f[i].name;
+    e=&a.e[i];
+    memset(e,0,sizeof(struct indexentry));
+    e->series=a.nseries-1;
+    e->k=f[i].k;
+    e->size=f[i].size;
+    e->mtime=f[i].mtime;
+    if (f[i].status==0)
+      continue;
+    e->version=f[i].version;
+    e->nsub=f[i].nsub;
+    e->nchan=f[i].nchan;
+    e->nbits=f[i].nbits;
+    e->nplane=f[i].nplane;
+    e->truncated=f[i].truncated;
+    e->freq=f[i].freq;
+    e->samp_rate=f[i].samp_rate;
+    e->mjd0=f[i].mjd0;
+    e->mjd1=f[i].mjd1;
+    e->length=f[i].length;
+  }
+  for (i=0;i<n;i++)
+    f[i].name[f[i].base]='\0';
+
+  // Write index
+  if (write_archive(indexname,&a)==0) {
+    fprintf(stderr,"Failed to write %s\n",indexname);
+    return -1;
+  }
+  printf("%s: %d series, %d files, %d read, %d unchanged, %d removed\n",indexname,a.nseries,a.nfile,nsample,nreuse+nkeep,old.nfile-nfound-nkeep);
+
+  // Free
+  for (i=0;i<n;i++)
+    free(f[i].name);
+  free(f);
+  free(a.prefix);
+  free(a.e);
+  for (i=0;i<ndir;i++)
+    free(dirs[i]);
+  free(dirs);
+  free_archive(&old);
+
+  return 0;
+}
@@ -1,44 +1,239 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "rftime.h"
+#include "rfio.h"
 
-int main(int argc,char *argv[])
+#define NTHREAD 8 // Threads sampling file headers
+
+void usage(void)
+{
+  printf("rfinfo: Summarize spectrogram series\n\n");
+  printf("Usage: rfinfo [options] <prefix|file|directory> ...\n\n");
+  printf("-j              JSON summary\n");
+  printf("-c              Coverage report with gaps\n");
+  printf("-t <seconds>    Shortest gap to report [subint length]\n");
+  printf("-h              This help\n\n");
+  printf("Directories are summarized per series. Without -j or -c a line per\n");
+  printf("series gives the prefix, frequency (MHz), bandwidth (MHz), channels\n");
+  printf("and number of files.\n");
+
+  return;
+}
+
+// Print a string as a JSON string
+void json_string(char *s,int n)
+{
+  int i;
+
+  putchar('"');
+  for (i=0;i<n && s[i]!='\0';i++) {
+    if (s[i]=='"' || s[i]=='\\')
+      printf("\\%c",s[i]);
+    else if ((unsigned char) s[i]<0x20)
+      printf("\\u%04x",s[i]);
+    else
+      putchar(s[i]);
+  }
+  putchar('"');
+
+  return;
+}
+
+// Summarize files f[0..n-1] of one series
+void summarize(struct fileinfo *f,int n,char *label,int json,int coverage,float tgap,int first)
 {
-  int i,firstfile=1,status;
-  FILE *file;
-  char header[256],filename[128],nfd[32],fileroot[128];
-  double freq,samp_rate;
-  float length;
-  int nchan;
-
-  if (strchr(argv[1],'_')!=NULL) {
-    strncpy(fileroot,argv[1],strlen(argv[1])-11);
-    fileroot[strlen(argv[1])-11]='\0';
+  int i,j,nsub=0,ngap=0,i0=-1,i1=-1;
+  char nfd0[32]="",nfd1[32]="",nfd[32];
+  double exposure=0.0,gapsum=0.0,dt,tol;
+
+  // Totals over readable files
+  for (i=0;i<n;i++) {
+    if (f[i].status==0)
+      continue;
+    if (i0<0)
+      i0=i;
+    i1=i;
+    nsub+=f[i].nsub;
+    exposure+=f[i].nsub*f[i].length;
+  }
+  if (i0>=0) {
+    mjd2nfd(f[i0].mjd0,nfd0);
+    mjd2nfd(f[i1].mjd1,nfd1);
+  }
+
+  // Legacy summary line
+  if (json==0 && coverage==0) {
+    printf("%s %8.3lf %8.3lf %d %d\n",label,((i0>=0) ? f[i0].freq : 0.0)*1e-6,((i0>=0) ? f[i0].samp_rate : 0.0)*1e-6,(i0>=0) ? f[i0].nchan : 0,n);
+    return;
+  }
+
+  if (json==1) {
+    printf("%s\n  {\"prefix\": ",(first==1) ? "" : ",");
+    json_string(label,strlen(label));
+    if (i0>=0) {
+      printf(", \"format\": %d, \"freq\": %.3f, \"bw\": %.3f, \"nchan\": %d, \"nbits\": %d, \"nplane\": %d",f[i0].version,f[i0].freq,f[i0].samp_rate,f[i0].nchan,f[i0].nbits,f[i0].nplane);
+      printf(", \"start\": \"%s\", \"end\": \"%s\", \"mjd_start\": %.9f, \"mjd_end\": %.9f, \"span\": %.3f",nfd0,nfd1,f[i0].mjd0,f[i1].mjd1,(f[i1].mjd1-f[i0].mjd0)*86400.0);
+    }
+    printf(", \"nfile\": %d, \"first_file\": %d, \"last_file\": %d, \"nsub\": %d, \"exposure\": %.3f",n,f[0].k,f[n-1].k,nsub,exposure);
+    printf(",\n   \"gaps\": [");
+  } else {
+    printf("%s: %d files (%06d-%06d), %d subints",label,n,f[0].k,f[n-1].k,nsub);
+    if (i0>=0)
+      printf(", %s to %s, %.3f s span, %.3f s exposure",nfd0,nfd1,(f[i1].mjd1-f[i0].mjd0)*86400.0,exposure);
+    printf("\n");
+  }
+
+  // Gaps between consecutive readable files
+  for (i=i0,j=-1;i>=0 && i<=i1;i++) {
+    if (f[i].status==0)
+      continue;
+    if (j>=0) {
+      dt=(f[i].mjd0-f[j].mjd1)*86400.0;
+      tol=(tgap>0.0) ? tgap : f[j].length;
+      if (dt>tol) {
+	mjd2nfd(f[j].mjd1,nfd);
+	gapsum+=dt;
+	if (json==1)
+	  printf("%s{\"after_file\": %d, \"start\": \"%s\", \"length\": %.3f}",(ngap==0) ? "" : ", ",f[j].k,nfd,dt);
+	else
+	  printf("  gap of %.3f s after %06d at %s\n",dt,f[j].k,nfd);
+	ngap++;
+      }
+    }
+    j=i;
+  }
+
+  // Missing, unreadable and truncated files
+  if (json==1) {
+    printf("],\n   \"gap_total\": %.3f, \"missing\": [",gapsum);
+    for (i=1,j=0;i<n;i++)
+      if (f[i].k!=f[i-1].k+1)
+	printf("%s[%d, %d]",(j++==0) ? "" : ", ",f[i-1].k+1,f[i].k-1);
+    printf("], \"unreadable\": [");
+    for (i=0,j=0;i<n;i++)
+      if (f[i].status==0)
+	printf("%s%d",(j++==0) ? "" : ", ",f[i].k);
+    printf("], \"truncated\": [");
+    for (i=0,j=0;i<n;i++)
+      if (f[i].status==1 && f[i].truncated==1)
+	printf("%s%d",(j++==0) ? "" : ", ",f[i].k);
+    printf("]}");
   } else {
-    strcpy(fileroot,argv[1]);
+    for (i=1;i<n;i++)
+      if (f[i].k!=f[i-1].k+1)
+	printf("  files %06d-%06d missing\n",f[i-1].k+1,f[i].k-1);
+    for (i=0;i<n;i++) {
+      if (f[i].status==0)
+	printf("  file %06d unreadable\n",f[i].k);
+      else if (f[i].truncated==1)
+	printf("  file %06d truncated\n",f[i].k);
+    }
+    if (i0>=0 && f[i1].mjd1>f[i0].mjd0)
+      printf("  %d gaps, %.3f s, coverage %.2f%%\n",ngap,gapsum,100.0*exposure/((f[i1].mjd1-f[i0].mjd0)*86400.0));
   }
 
-  // Open first file
-  for (i=0;;i++) {
-    sprintf(filename,"%s_%06d.bin",fileroot,i);
-    file=fopen(filename,"r");
-    
-    // Break if file does not exist
-    if (file==NULL) 
+  return;
+}
+
+int main(int argc,char *argv[])
+{
+  int i,j,k,m,arg=0,json=0,coverage=0,n=0,nalloc=0,nseries=0;
+  char dir[1024],base[1024],*ptr;
+  float tgap=0.0;
+  struct fileinfo *f=NULL;
+  struct stat st;
+
+  // Read arguments
+  while ((arg=getopt(argc,argv,"jct:h"))!=-1) {
+    switch (arg) {
+
+    case 'j':
+      json=1;
+      break;
+
+    case 'c':
+      coverage=1;
+      break;
+
+    case 't':
+      tgap=atof(optarg);
       break;
 
-    // Read header
-    if (firstfile==1) {
-      // Read header
-      status=fread(header,sizeof(char),256,file);
-      status=sscanf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\n",nfd,&freq,&samp_rate,&length,&nchan);
-      firstfile=0;
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 0;
+    }
+  }
+  if (optind>=argc) {
+    usage();
+    return 0;
+  }
+
+  // List files from directory entries
+  for (i=optind;i<argc;i++) {
+    if (stat(argv[i],&st)==0 && S_ISDIR(st.st_mode)) {
+      strcpy(dir,argv[i]);
+      for (m=strlen(dir);m>1 && dir[m-1]=='/';m--)
+	dir[m-1]='\0';
+      scan_directory(dir,NULL,0,&f,&n,&nalloc);
+      continue;
+    }
+    strcpy(base,argv[i]);
+    if ((m=series_name(base,&k))>0)
+      base[m]='\0';
+    ptr=strrchr(base,'/');
+    if (ptr!=NULL) {
+      *ptr='\0';
+      strcpy(dir,(ptr==base) ? "/" : base);
+      scan_directory(dir,ptr+1,0,&f,&n,&nalloc);
+    } else {
+      scan_directory(".",base,0,&f,&n,&nalloc);
     }
+  }
+  if (n==0) {
+    fprintf(stderr,"No spectrogram files found\n");
+    return -1;
+  }
+  qsort(f,n,sizeof(struct fileinfo),compare_files);
+
+  // Files listed more than once
+  for (i=1,j=1;i<n;i++) {
+    if (strcmp(f[i].name,f[j-1].name)==0) {
+      free(f[i].name);
+      continue;
+    }
+    f[j++]=f[i];
+  }
+  n=j;
+
+  // Sample headers in parallel
+  sample_files(f,n,NTHREAD);
 
-    fclose(file);
+  // Summarize series in order
+  if (json==1)
+    printf("{\"series\": [");
+  for (i=0;i<n;i=j) {
+    for (j=i+1;j<n && f[j].base==f[i].base && strncmp(f[j].name,f[i].name,f[i].base)==0;j++);
+    f[i].name[f[i].base]='\0';
+    summarize(f+i,j-i,f[i].name,json,coverage,tgap,nseries==0);
+    f[i].name[f[i].base]='_';
+    nseries++;
   }
+  if (json==1)
+    printf("\n]}\n");
 
-  printf("%s %8.3lf %8.3lf %d %d\n",argv[1],freq*1e-6,samp_rate*1e-6,nchan,i);
+  // Free
+  for (i=0;i<n;i++)
+    free(f[i].name);
+  free(f);
 
   return 0;
 }
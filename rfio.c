@@ -2,22 +2,769 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 #include "rftime.h"
 #include "rfio.h"
 
-struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,double foff)
-{
-  int i,j,k,l,flag=0,status,msub,ibin,nadd,nbits=-32;
-  char filename[128],header[256],nfd[32];
+#define NTHREAD 4 // Prefetch threads
+#define NSLOT 8 // Files decoded ahead of the consumer
+#define PREFETCH_MB 256 // Decoded data held ahead of the consumer (MB)
+#define TILE_NSUB 256 // Subints per tile of paged spectrograms
+#define TILE_NCHAN 64 // Channels per tile of paged spectrograms
+
+// Header fields that vary between subints
+#define FIELD_UTC 0
+#define FIELD_LENGTH 1
+#define FIELD_MEAN 2
+#define FIELD_RMS 3
+#define FIELD_NAVG 4
+
+// Piece of a decoded file, handed over while the next one is decoded
+struct prefetch {
+  int k,j0,n,last,ready,fatal,nstat,nalloc,nallocnext;
+  long nbyte;
+  double t,*mjd,*mjdnext;
+  float *z,*length,*znext,*lengthnext;
+  struct substats *stat;
+};
+
+// State shared with the prefetch threads; files are claimed until the
+// subints they hold cover the requested nsub
+struct reader {
+  char *prefix;
+  int isub,nch,nchan,nraw,j0,plane,fbin,reduce,stats,mslot,nsub;
+  int next,done,stop,nopen,nfile;
+  long ncover;
+  struct prefetch slot[NSLOT];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// Incremental decoder of a single file
+struct decoder {
   FILE *file;
+  int version,nbits,nwin,nplane,n;
+  float *z,*zs;
+  char *cz;
+  int32_t *win;
+  struct textheader th;
+  struct binheader bh;
+};
+void close_decoder(struct decoder *d);
+
+// Chunked reader on top of the prefetch threads
+struct specstream {
+  struct reader r;
+  pthread_t thread[NTHREAD];
   struct spectrogram s;
-  float *z,zavg,zstd;
+  struct prefetch *p;
+  struct decoder d;
+  float *row,*acc;
+  int nchunk,nbin,nsub,k,jsub,l,end,follow,ifd,nstat;
+};
+
+// Tiles of a paged spectrogram, channel-fastest in a cache file and held
+// in memory up to a budget with least recently used eviction
+struct specpager {
+  int fd,ntj,nslot,nload,slast;
+  long ntile,clock,tlast,tmiss;
+  int *map;
+  long *tile,*used;
+  float *z;
+};
+
+// Output split into files
+struct specwriter {
+  char prefix[256];
+  int nsub,nbits,version,k,n;
+  FILE *file;
+  float *z;
   char *cz;
-  int nch,j0,j1;
-  double freq,samp_rate;
-  float length;
-  int nchan,dummy;
-  float s1,s2;
+  int64_t *offset;
+  struct binheader bh;
+};
+
+// Float to half precision bits, rounding to nearest even; branch-light so
+// the conversion loops vectorize
+static inline uint16_t float_to_half(float x)
+{
+  union {float f; uint32_t u;} f,magic;
+  uint32_t sign,odd;
+  uint16_t h;
+
+  f.f=x;
+  sign=f.u&0x80000000u;
+  f.u^=sign;
+  if (f.u>=(uint32_t) (127+16)<<23) {
+    // Overflow to infinity, NaN stays NaN
+    h=(f.u>(uint32_t) 255<<23) ? 0x7e00 : 0x7c00;
+  } else if (f.u<(uint32_t) 113<<23) {
+    // Subnormal or zero
+    magic.u=(uint32_t) ((127-15)+(23-10)+1)<<23;
+    f.f+=magic.f;
+    h=f.u-magic.u;
+  } else {
+    odd=(f.u>>13)&1;
+    f.u+=((uint32_t) (15-127)<<23)+0xfff+odd;
+    h=f.u>>13;
+  }
+
+  return h|(sign>>16);
+}
+
+// Half precision bits to float
+static inline float half_to_float(uint16_t h)
+{
+  union {float f; uint32_t u;} f,magic;
+  uint32_t exp;
+
+  magic.u=(uint32_t) 113<<23;
+  f.u=(uint32_t) (h&0x7fff)<<13;
+  exp=f.u&((uint32_t) 0x7c00<<13);
+  f.u+=(uint32_t) (127-15)<<23;
+  if (exp==(uint32_t) 0x7c00<<13) {
+    f.u+=(uint32_t) (128-16)<<23;
+  } else if (exp==0) {
+    f.u+=1<<23;
+    f.f-=magic.f;
+  }
+  f.u|=(uint32_t) (h&0x8000)<<16;
+
+  return f.f;
+}
+
+// Round to the nearest 8 bit level, NaN to zero
+static inline uint8_t quantize(float x)
+{
+  if (!(x>0.0))
+    return 0;
+  if (x>=255.0)
+    return 255;
+
+  return (uint8_t) (x+0.5);
+}
+
+// Read plane of a sparse subint and expand its channel windows to nch channels
+int read_sparse(FILE *file,float *z,int nch,int nwin,int32_t *win,float *zs,char *cz,int nbits,float zavg,float zstd,int nplane,int plane)
+{
+  int i,j,n,status=0;
+  long nbyte;
+  double s1;
+
+  // Check windows
+  for (i=0,n=0;i<nwin;i++) {
+    if (win[2*i]<0 || win[2*i+1]<0 || win[2*i]+win[2*i+1]>nch)
+      return 0;
+    n+=win[2*i+1];
+  }
+  nbyte=(nbits==8) ? sizeof(char) : sizeof(float);
+
+  // Skip preceding planes
+  if (plane>0)
+    fseek(file,plane*n*nbyte,SEEK_CUR);
+
+  // Read stored channels
+  if (nbits==-32) {
+    status=fread(zs,sizeof(float),n,file);
+  } else if (nbits==8) {
+    status=fread(cz,sizeof(char),n,file);
+    for (j=0;j<n;j++)
+      zs[j]=6.0/256.0*(float) cz[j]*zstd+zavg;
+  }
+  if (status!=n)
+    return 0;
+
+  // Skip remaining planes
+  if (plane<nplane-1)
+    fseek(file,(nplane-1-plane)*n*nbyte,SEEK_CUR);
+
+  // Fill unstored channels with the mean of the stored ones
+  for (j=0,s1=0.0;j<n;j++)
+    s1+=zs[j];
+  s1/=(double) n;
+  for (j=0;j<nch;j++)
+    z[j]=s1;
+
+  // Expand
+  for (i=0,n=0;i<nwin;i++)
+    for (j=0;j<win[2*i+1];j++,n++)
+      z[win[2*i]+j]=zs[n];
+
+  return nch;
+}
+
+// Read channels j0 to j0+n of a plane of a dense subint, seeking past the others
+int read_dense(FILE *file,float *z,int nch,int j0,int n,char *cz,int nbits,float zavg,float zstd,int nplane,int plane)
+{
+  int j,status=0;
+  long nbyte,nskip;
+
+  nbyte=(nbits==8) ? sizeof(char) : sizeof(float);
+
+  // Skip preceding planes and channels
+  nskip=(long) plane*nch+j0;
+  if (nskip>0)
+    fseek(file,nskip*nbyte,SEEK_CUR);
+
+  // Read requested channels
+  if (nbits==-32) {
+    status=fread(z+j0,sizeof(float),n,file);
+  } else if (nbits==8) {
+    status=fread(cz+j0,sizeof(char),n,file);
+    for (j=j0;j<j0+n;j++)
+      z[j]=6.0/256.0*(float) cz[j]*zstd+zavg;
+  }
+
+  // Skip remaining channels and planes
+  nskip=(long) (nplane-plane)*nch-j0-n;
+  if (nskip>0)
+    fseek(file,nskip*nbyte,SEEK_CUR);
+
+  return status;
+}
+
+// Integer parser for YYYY-MM-DDTHH:MM:SS.sss, falls back to nfd2mjd
+double parse_nfd(char *nfd)
+{
+  int i,k,d[6],w[6]={4,2,2,2,2,2};
+  long frac=0,scale=1;
+  float sec;
+  char *c=nfd;
+
+  // Date and time digits
+  for (i=0;i<6;i++) {
+    for (k=0,d[i]=0;k<w[i];k++,c++) {
+      if (*c<'0' || *c>'9')
+	return nfd2mjd(nfd);
+      d[i]=10*d[i]+*c-'0';
+    }
+    if (i<5 && *c++!="--T::"[i])
+      return nfd2mjd(nfd);
+  }
+
+  // Fraction of second
+  if (*c=='.')
+    for (c++;*c>='0' && *c<='9' && scale<1000000000;c++) {
+      frac=10*frac+*c-'0';
+      scale*=10;
+    }
+  sec=d[5]+(double) frac/(double) scale;
+
+  return date2mjd(d[0],d[1],d[2]+d[3]/24.0+d[4]/1440.0+sec/86400.0);
+}
+
+// Parse all keywords and cache the positions of the varying fields
+int parse_header_full(char *buf,struct textheader *h)
+{
+  int i,k,status;
+  char *ptr;
+  static char *keyword[NFIELD]={"\nUTC_START","\nLENGTH","\nMEAN","\nRMS","\nNAVG"};
+
+  h->nfield=0;
+  status=sscanf(buf,"HEADER\nUTC_START    %31s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\n",h->nfd,&h->freq,&h->samp_rate,&h->length,&h->nchan,&h->nsub);
+  if (status<5)
+    return 0;
+  if (status==5)
+    h->nsub=0;
+  h->mjd=nfd2mjd(h->nfd);
+
+  // Optional keywords
+  h->nbits=(strstr(buf,"NBITS         8")!=NULL) ? 8 : -32;
+  h->zavg=((ptr=strstr(buf,"\nMEAN"))!=NULL) ? strtof(ptr+5,NULL) : 0.0;
+  h->zstd=((ptr=strstr(buf,"\nRMS"))!=NULL) ? strtof(ptr+4,NULL) : 0.0;
+  h->nwin=((ptr=strstr(buf,"\nNWIN"))!=NULL) ? atoi(ptr+5) : 0;
+  h->nplane=((ptr=strstr(buf,"\nNPLANE"))!=NULL) ? atoi(ptr+7) : 1;
+  h->navg=((ptr=strstr(buf,"\nNAVG"))!=NULL) ? atoi(ptr+5) : 0;
+
+  // Varying fields, sorted by position
+  for (k=0;k<NFIELD;k++) {
+    ptr=strstr(buf,keyword[k]);
+    if (ptr==NULL)
+      continue;
+    ptr+=strlen(keyword[k]);
+    ptr+=strspn(ptr," ");
+    for (i=h->nfield;i>0 && h->pos[i-1]>ptr-buf;i--) {
+      h->field[i]=h->field[i-1];
+      h->pos[i]=h->pos[i-1];
+      h->len[i]=h->len[i-1];
+    }
+    h->field[i]=k;
+    h->pos[i]=ptr-buf;
+    h->len[i]=strcspn(ptr," \n");
+    h->nfield++;
+  }
+  memcpy(h->text,buf,257);
+
+  return 1;
+}
+
+// Parse a 256 byte header, returns 0 if it is not valid; h->nfield
+// must be 0 before the first call
+int parse_header(char *header,struct textheader *h)
+{
+  int i,n,m,p,q;
+  char buf[257],*val;
+
+  memcpy(buf,header,256);
+  buf[256]='\0';
+
+  // Compare the fixed text between the varying fields, which are reparsed
+  for (i=0,p=0,q=0;i<h->nfield;i++) {
+    n=h->pos[i]-p;
+    if (q+n>256 || memcmp(buf+q,h->text+p,n)!=0)
+      break;
+    q+=n;
+    p=h->pos[i]+h->len[i];
+    val=buf+q;
+    m=strcspn(val," \n");
+    if (h->field[i]==FIELD_UTC) {
+      if (m>=32)
+	break;
+      memcpy(h->nfd,val,m);
+      h->nfd[m]='\0';
+      h->mjd=parse_nfd(val);
+    } else if (h->field[i]==FIELD_LENGTH) {
+      h->length=strtof(val,NULL);
+    } else if (h->field[i]==FIELD_MEAN) {
+      h->zavg=strtof(val,NULL);
+    } else if (h->field[i]==FIELD_RMS) {
+      h->zstd=strtof(val,NULL);
+    } else if (h->field[i]==FIELD_NAVG) {
+      h->navg=atoi(val);
+    }
+    q+=m;
+  }
+  if (h->nfield>0 && i==h->nfield && strcmp(buf+q,h->text+p)==0)
+    return 1;
+
+  return parse_header_full(buf,h);
+}
+
+// Value of rank k among n values, reordering them
+float select_rank(float *z,int n,int k)
+{
+  int i,j,l=0,r=n-1;
+  float x,t;
+
+  while (l<r) {
+    x=z[k];
+    for (i=l,j=r;i<=j;) {
+      while (z[i]<x)
+	i++;
+      while (z[j]>x)
+	j--;
+      if (i<=j) {
+	t=z[i];
+	z[i]=z[j];
+	z[j]=t;
+	i++;
+	j--;
+      }
+    }
+    if (j<k)
+      l=i;
+    if (k<i)
+      r=j;
+  }
+
+  return z[k];
+}
+
+// Reduce n bins of fbin adjacent channels of zin into zout
+void reduce_channels(float *zin,float *zout,int n,int fbin,int reduce,float *buf)
+{
+  int j,k;
+  float *z,zs,zm;
+
+  for (j=0;j<n;j++) {
+    z=zin+(long) j*fbin;
+    if (reduce==REDUCE_MAX) {
+      for (k=1,zm=z[0];k<fbin;k++)
+	zm=(z[k]>zm) ? z[k] : zm;
+      zout[j]=zm;
+    } else if (reduce==REDUCE_MEDIAN) {
+      memcpy(buf,z,sizeof(float)*fbin);
+      zout[j]=select_rank(buf,fbin,fbin/2);
+    } else {
+      for (k=0,zs=0.0;k<fbin;k++)
+	zs+=z[k];
+      zout[j]=zs/(float) fbin;
+    }
+  }
+
+  return;
+}
+
+// Statistics of n channels, skipping non-finite values like
+// spectrogram_stats; buf holds n values for the median
+void subint_stats(float *z,int n,struct substats *ss,float *buf)
+{
+  int j,k,m;
+  float dz;
+
+  memset(ss,0,sizeof(struct substats));
+  ss->nchan=n;
+
+  // Average, maximum and finite values
+  for (j=0,m=0,ss->zmax=-INFINITY;j<n;j++) {
+    if (isnan(z[j]) || isinf(z[j]))
+      continue;
+    ss->zavg+=z[j];
+    if (z[j]>ss->zmax)
+      ss->zmax=z[j];
+    buf[m++]=z[j];
+  }
+  ss->zavg/=(float) n;
+
+  // Deviation
+  for (j=0;j<m;j++) {
+    dz=buf[j]-ss->zavg;
+    ss->zstd+=dz*dz;
+  }
+  ss->zstd=sqrt(ss->zstd/(float) n);
+
+  // Median and histogram
+  if (m==0)
+    return;
+  ss->zmed=select_rank(buf,m,m/2);
+  for (j=0;j<m;j++) {
+    k=(ss->zstd>0.0) ? (int) floor((buf[j]-ss->zmed)/ss->zstd)+HIST_OFFSET : HIST_OFFSET;
+    if (k<0)
+      k=0;
+    if (k>=NHIST)
+      k=NHIST-1;
+    ss->hist[k]++;
+  }
+
+  return;
+}
+
+// Read the statistics sidecar of file k of prefix, returns NULL if absent
+struct substats *read_stats(char *prefix,int k,int *nstat)
+{
+  int nalloc=0;
+  char filename[300];
+  FILE *file;
+  struct substats *ss=NULL;
+
+  *nstat=0;
+  sprintf(filename,STATS_FORMAT,prefix,k);
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return NULL;
+  for (;;(*nstat)++) {
+    if (*nstat>=nalloc) {
+      nalloc=(nalloc==0) ? 64 : 2*nalloc;
+      ss=(struct substats *) realloc(ss,sizeof(struct substats)*nalloc);
+    }
+    if (fread(&ss[*nstat],sizeof(struct substats),1,file)!=1)
+      break;
+  }
+  fclose(file);
+
+  return ss;
+}
+
+// Open a file for decoding, returns 0 if it is absent, -1 if its channel
+// layout does not match or is not supported and -2 if its window table
+// is incomplete
+int open_decoder(struct decoder *d,struct reader *r,char *filename)
+{
+  memset(d,0,sizeof(struct decoder));
+  d->nbits=-32;
+  d->nplane=1;
+
+  // Open file
+  d->file=fopen(filename,"r");
+  if (d->file==NULL)
+    return 0;
+
+  // Allocate
+  d->z=(float *) malloc(sizeof(float)*r->nch);
+  d->zs=(float *) malloc(sizeof(float)*r->nch);
+  d->cz=(char *) malloc(sizeof(char)*r->nch);
+  d->win=(int32_t *) malloc(sizeof(int32_t)*2*r->nch);
+
+  // Indexed files have a single header and window table
+  d->version=read_binheader(d->file,&d->bh)+1;
+  if (d->version==2) {
+    d->nbits=d->bh.nbits;
+    d->nwin=d->bh.nwin;
+    d->nplane=d->bh.nplane;
+    if (d->bh.nchan!=r->nch || d->nwin>r->nch) {
+      fprintf(stderr,"Channel layout of %s does not match\n",filename);
+      close_decoder(d);
+      return -1;
+    }
+    if (d->nbits!=8 && d->nbits!=-32) {
+      fprintf(stderr,"Unsupported NBITS %d in %s\n",d->nbits,filename);
+      close_decoder(d);
+      return -1;
+    }
+    if (fread(d->win,sizeof(int32_t),2*d->nwin,d->file)!=2*d->nwin) {
+      close_decoder(d);
+      return -2;
+    }
+  }
+
+  return 1;
+}
+
+// Decode the requested channels of the next subint into z, returns 0 if
+// no complete subint follows, leaving the file at its start
+int decode_subint(struct decoder *d,struct reader *r,float *z,double *mjd,float *length)
+{
+  int n,status;
+  long pos;
+  char header[256];
+  float zavg=0.0,zstd=1.0;
+  struct subheader sh;
+
+  pos=ftell(d->file);
+  if (d->version==2) {
+    // Files being written get their index on closing
+    if (d->bh.index==0) {
+      rewind(d->file);
+      read_binheader(d->file,&d->bh);
+    }
+    if (d->bh.index>0 && d->n>=d->bh.nsub)
+      return 0;
+    fseek(d->file,subint_offset(d->file,&d->bh,d->n),SEEK_SET);
+    status=fread(&sh,sizeof(struct subheader),1,d->file);
+    if (status!=1)
+      return 0;
+    *mjd=(double) sh.tns/86400e9;
+    *length=sh.length;
+    zavg=sh.zavg;
+    zstd=sh.zstd;
+  } else {
+    // Read header
+    status=fread(header,sizeof(char),256,d->file);
+    if (status!=256 || parse_header(header,&d->th)==0) {
+      fseek(d->file,pos,SEEK_SET);
+      return 0;
+    }
+    *mjd=d->th.mjd;
+    *length=d->th.length;
+    zavg=d->th.zavg;
+    zstd=d->th.zstd;
+    d->nbits=d->th.nbits;
+    d->nplane=d->th.nplane;
+
+    // Sparse subints store channel windows
+    d->nwin=d->th.nwin;
+    if (d->nwin>0 && d->nwin<=r->nch && fread(d->win,sizeof(int32_t),2*d->nwin,d->file)!=2*d->nwin) {
+      fseek(d->file,pos,SEEK_SET);
+      return 0;
+    }
+  }
+  if (r->plane>=d->nplane) {
+    fseek(d->file,pos,SEEK_SET);
+    return 0;
+  }
+
+  // Read buffer
+  if (d->nwin>0 && d->nwin<=r->nch) {
+    n=1;
+    status=read_sparse(d->file,d->z,r->nch,d->nwin,d->win,d->zs,d->cz,d->nbits,zavg,zstd,d->nplane,r->plane);
+  } else {
+    n=(r->j0+r->nraw<r->nch) ? r->nraw : r->nch-r->j0;
+    status=read_dense(d->file,d->z,r->nch,r->j0,n,d->cz,d->nbits,zavg,zstd,d->nplane,r->plane);
+  }
+  if (status<n) {
+    fseek(d->file,pos,SEEK_SET);
+    return 0;
+  }
+
+  // Store requested channels
+  if (r->fbin==1)
+    memcpy(z,d->z+r->j0,sizeof(float)*r->nchan);
+  else
+    reduce_channels(d->z+r->j0,z,r->nchan,r->fbin,r->reduce,d->zs);
+  d->n++;
+
+  return 1;
+}
+
+// Close a decoded file
+void close_decoder(struct decoder *d)
+{
+  if (d->file!=NULL)
+    fclose(d->file);
+  free(d->z);
+  free(d->zs);
+  free(d->cz);
+  free(d->win);
+  memset(d,0,sizeof(struct decoder));
+
+  return;
+}
+
+// Subints the header of a decoded file claims, 0 if unknown
+int decoder_nsub(struct decoder *d)
+{
+  long pos;
+  char header[256];
+  struct textheader th;
+
+  if (d->version==2)
+    return (d->bh.index>0) ? d->bh.nsub : 0;
+  pos=ftell(d->file);
+  th.nsub=0;
+  if (fread(header,sizeof(char),256,d->file)!=256 || parse_header(header,&th)==0)
+    th.nsub=0;
+  fseek(d->file,pos,SEEK_SET);
+
+  return th.nsub;
+}
+
+// Decode file k into a prefetch slot, at most mslot subints at a time;
+// each piece is handed over once the consumer released the previous one
+void decode_file(struct reader *r,int k,struct prefetch *p)
+{
+  int n,j0,status,last,nest,nt,nstat=0;
+  char filename[128];
+  long pos,pos0=0;
+  float *zt;
+  double *mt;
+  struct decoder d;
+  struct timeval start,end;
+
+  p->k=k;
+  gettimeofday(&start,0);
+
+  // Open file, counting the subints its header claims
+  sprintf(filename,"%s_%06d.bin",r->prefix,k+r->isub);
+  status=open_decoder(&d,r,filename);
+  nest=(status==1) ? decoder_nsub(&d) : 0;
+  pthread_mutex_lock(&r->lock);
+  r->nopen--;
+  r->ncover+=nest;
+  if (status!=1 && (r->nfile<0 || k+1<r->nfile))
+    r->nfile=k+1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  // Statistics sidecar, used for pieces it covers
+  free(p->stat);
+  p->stat=NULL;
+  if (r->stats==1 && status==1) {
+    p->stat=read_stats(r->prefix,k+r->isub,&nstat);
+    if (nstat>0 && p->stat[0].nchan!=r->nch)
+      nstat=0;
+  }
+
+  // Loop over pieces of the file
+  for (j0=0,last=0;last==0;j0+=n) {
+    for (n=0;status==1 && n<r->mslot;n++) {
+      // Grow piece
+      if (n>=p->nallocnext) {
+	p->nallocnext=(p->nallocnext==0) ? 64 : 2*p->nallocnext;
+	if (p->nallocnext>r->mslot)
+	  p->nallocnext=r->mslot;
+	p->znext=(float *) realloc(p->znext,sizeof(float)*p->nallocnext*r->nchan);
+	p->mjdnext=(double *) realloc(p->mjdnext,sizeof(double)*p->nallocnext);
+	p->lengthnext=(float *) realloc(p->lengthnext,sizeof(float)*p->nallocnext);
+      }
+      if (decode_subint(&d,r,p->znext+(long) n*r->nchan,&p->mjdnext[n],&p->lengthnext[n])==0)
+	break;
+    }
+    last=(n<r->mslot || status!=1);
+
+    // Throughput
+    gettimeofday(&end,0);
+    pos=(d.file!=NULL) ? ftell(d.file) : 0;
+
+    // Hand over
+    pthread_mutex_lock(&r->lock);
+    while (r->stop==0 && p->ready==1)
+      pthread_cond_wait(&r->cond,&r->lock);
+    if (r->stop==1) {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    zt=p->z;
+    p->z=p->znext;
+    p->znext=zt;
+    zt=p->length;
+    p->length=p->lengthnext;
+    p->lengthnext=zt;
+    mt=p->mjd;
+    p->mjd=p->mjdnext;
+    p->mjdnext=mt;
+    nt=p->nalloc;
+    p->nalloc=p->nallocnext;
+    p->nallocnext=nt;
+    p->n=(status==0) ? -1 : n;
+    p->j0=j0;
+    p->last=last;
+    p->fatal=(status<0);
+    p->nstat=(nstat>=j0+n) ? nstat : 0;
+    p->t=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6;
+    p->nbyte=pos-pos0;
+    p->ready=1;
+    if (last==1)
+      r->ncover+=j0+n-nest;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    start=end;
+    pos0=pos;
+  }
+
+  // Close file
+  close_decoder(&d);
+
+  return;
+}
+
+// Prefetch thread, claiming files up to NSLOT ahead of the consumer until
+// they cover the requested subints
+void *prefetch_thread(void *arg)
+{
+  int k;
+  struct reader *r=(struct reader *) arg;
+
+  for (;;) {
+    // Claim next file once the subints of the claimed ones are known
+    pthread_mutex_lock(&r->lock);
+    while (r->stop==0 && (r->next-r->done>=NSLOT || (r->nfile>=0 && r->next>=r->nfile) || (r->nsub>0 && (r->nopen>0 || r->ncover>=r->nsub))))
+      pthread_cond_wait(&r->cond,&r->lock);
+    if (r->stop==1) {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    k=r->next++;
+    r->nopen++;
+    pthread_mutex_unlock(&r->lock);
+
+    decode_file(r,k,&r->slot[k%NSLOT]);
+  }
+
+  return NULL;
+}
+
+// Open a stream of chunks, prefetching whole files or following files
+// as they are written
+struct specstream *open_stream(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int store,int nchunk,int follow)
+{
+  int k,status,msub,nch,j0,j1,nplane=1;
+  char filename[128],header[256];
+  FILE *file;
+  struct textheader th;
+  struct binheader bh;
+  struct subheader sh;
+  struct specstream *st;
+  struct spectrogram s;
 
   // Open first file to get number of channels
   sprintf(filename,"%s_%06d.bin",prefix,isub);
@@ -26,23 +773,45 @@ struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,dou
   file=fopen(filename,"r");
   if (file==NULL) {
     printf("%s does not exist\n",filename);
-    s.nsub=0;
-    return s;
+    return NULL;
   }
 
   // Read header
-  status=fread(header,sizeof(char),256,file);
-  if (strstr(header,"NBITS         8")==NULL) {
-    status=sscanf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\n",s.nfd0,&s.freq,&s.samp_rate,&length,&nch,&msub);
+  if (read_binheader(file,&bh)==1) {
+    fseek(file,subint_offset(file,&bh,0),SEEK_SET);
+    status=fread(&sh,sizeof(struct subheader),1,file);
+    mjd2nfd((double) sh.tns/86400e9,s.nfd0);
+    s.freq=bh.freq;
+    s.samp_rate=bh.samp_rate;
+    nch=bh.nchan;
+    msub=bh.nsub;
+    nplane=bh.nplane;
   } else {
-    status=sscanf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %f\nRMS          %f",s.nfd0,&s.freq,&s.samp_rate,&length,&nch,&dummy,&zavg,&zstd);
-    nbits=8;
+    memset(&th,0,sizeof(struct textheader));
+    status=fread(header,sizeof(char),256,file);
+    if (status!=256 || parse_header(header,&th)==0) {
+      fprintf(stderr,"Failed to parse header of %s\n",filename);
+      fclose(file);
+      return NULL;
+    }
+    strcpy(s.nfd0,th.nfd);
+    s.freq=th.freq;
+    s.samp_rate=th.samp_rate;
+    nch=th.nchan;
+    msub=th.nsub;
+    nplane=th.nplane;
   }
   s.freq+=foff;
-  
+
   // Close file
   fclose(file);
 
+  // Check requested plane
+  if (plane<0 || plane>=nplane) {
+    fprintf(stderr,"Requested plane %d not present in %s\n",plane,filename);
+    return NULL;
+  }
+
   // Compute plotting channel
   if (f0>0.0 && df0>0.0) {
     s.nchan=(int) (df0/s.samp_rate*(float) nch);
@@ -52,189 +821,1576 @@ struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,dou
     
     if (j0<0 || j1>nch) {
       fprintf(stderr,"Requested frequency range out of limits\n");
-      s.nsub=0;
-      s.nchan=0;
-      return s;
+      return NULL;
     }
+
+    // Swap frequency range
+    s.freq=f0;
+    s.samp_rate=df0;
   } else {
     s.nchan=nch;
     j0=0;
     j1=s.nchan;
   }
 
-  // Read whole file if not specified
-  if (nsub==0 && msub>0)
-    nsub=msub;
-  
-  // Number of subints
-  s.nsub=nsub/nbin;
-  
-  // Allocate
-  s.z=(float *) malloc(sizeof(float)*s.nchan*s.nsub);
+  // Bin channels, dropping a partial last bin
+  if (fbin<1 || fbin>s.nchan || reduce<REDUCE_MEAN || reduce>REDUCE_MEDIAN) {
+    fprintf(stderr,"Cannot bin %d of %d channels\n",fbin,s.nchan);
+    return NULL;
+  }
+  s.freq+=0.5*s.samp_rate*((double) (s.nchan/fbin*fbin)/(double) s.nchan-1.0);
+  s.samp_rate*=(double) (s.nchan/fbin*fbin)/(double) s.nchan;
+  s.nchan/=fbin;
+
+  // Whole range in a single chunk
+  if (nchunk==0) {
+    if (nsub==0 && msub>0)
+      nsub=msub;
+    nchunk=nsub/nbin;
+  }
+
+  // Only complete bins
+  if (nsub>0)
+    nsub=(nsub/nbin)*nbin;
+
+  // Allocate chunk, compact forms binned through a float row
+  st=(struct specstream *) malloc(sizeof(struct specstream));
+  memset(st,0,sizeof(struct specstream));
+  s.nsub=nchunk;
+  s.layout=layout;
+  s.store=store;
+  s.z=NULL;
+  s.zh=NULL;
+  s.zb=NULL;
+  s.zscale=NULL;
+  s.zoffset=NULL;
+  s.pager=NULL;
+  if (store==STORE_HALF)
+    s.zh=(uint16_t *) malloc(sizeof(uint16_t)*s.nchan*s.nsub);
+  else if (store==STORE_BYTE)
+    s.zb=(uint8_t *) malloc(sizeof(uint8_t)*s.nchan*s.nsub);
+  else
+    s.z=(float *) malloc(sizeof(float)*s.nchan*s.nsub);
+  if (store!=STORE_FLOAT) {
+    s.zscale=(float *) malloc(sizeof(float)*s.nsub);
+    s.zoffset=(float *) malloc(sizeof(float)*s.nsub);
+    st->acc=(float *) calloc(s.nchan,sizeof(float));
+  }
   s.zavg=(float *) malloc(sizeof(float)*s.nsub);
   s.zstd=(float *) malloc(sizeof(float)*s.nsub);
-  z=(float *) malloc(sizeof(float)*nch);
-  cz=(char *) malloc(sizeof(char)*nch);
   s.mjd=(double *) malloc(sizeof(double)*s.nsub);
   s.length=(float *) malloc(sizeof(float)*s.nsub);
+  st->s=s;
+  st->nchunk=nchunk;
+  st->nbin=nbin;
+  st->nsub=nsub;
+  st->follow=follow;
+  st->ifd=-1;
+  st->r.prefix=prefix;
+  st->r.isub=isub;
+  st->r.nch=nch;
+  st->r.nchan=s.nchan;
+  st->r.nraw=s.nchan*fbin;
+  st->r.j0=j0;
+  st->r.plane=plane;
+  st->r.fbin=fbin;
+  st->r.reduce=reduce;
+  st->r.stats=(nbin==1 && fbin==1 && j0==0 && s.nchan==nch && plane==PLANE_MEAN);
+  st->r.nsub=nsub;
+  st->r.nfile=-1;
 
-  // Initialize
-  for (j=0;j<s.nchan*s.nsub;j++)
-    s.z[j]=0.0;
-  for (j=0;j<s.nsub;j++)
-    s.mjd[j]=0.0;
-
-  // Loop over files
-  for (k=0,i=0,l=0,ibin=0,nadd=0;l<nsub;k++) {
-    // Generate filename
-    sprintf(filename,"%s_%06d.bin",prefix,k+isub);
-
-    // Open file
-    file=fopen(filename,"r");
-    if (file==NULL) {
-      printf("%s does not exist\n",filename);
-      s.nsub=nsub;
-      break;
-    }
-    printf("opened %s\n",filename);
+  // Subints per decoded piece, keeping both pieces of all slots in budget
+  st->r.mslot=((long) PREFETCH_MB<<20)/(2*NSLOT*sizeof(float)*s.nchan);
+  if (nsub>0 && st->r.mslot>nsub)
+    st->r.mslot=nsub;
+  if (st->r.mslot<1)
+    st->r.mslot=1;
 
-    // Loop over contents of file
-    for (;l<nsub;l++,ibin++) {
-      // Read header
-      status=fread(header,sizeof(char),256,file);
+  // Files being written are decoded a subint at a time
+  if (follow==1) {
+    st->row=(float *) malloc(sizeof(float)*s.nchan);
+    return st;
+  }
 
-      if (status==0)
-	break;
-      if (nbits==-32)
-	status=sscanf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\n",nfd,&freq,&samp_rate,&length,&nchan,&msub);
-      else if (nbits==8)
-	status=sscanf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %f\nRMS          %f",nfd,&freq,&samp_rate,&length,&nchan,&dummy,&zavg,&zstd);
-
-      s.mjd[i]+=nfd2mjd(nfd)+0.5*length/86400.0;
-      s.length[i]+=length;
-      nadd++;
-
-      // Read buffer
-      if (nbits==-32) {
-	status=fread(z,sizeof(float),nch,file);
-      } else if (nbits==8) {
-	status=fread(cz,sizeof(char),nch,file);
-	for (j=0;j<nch;j++)
-	  z[j]=6.0/256.0*(float) cz[j]*zstd+zavg;
-      }
-      if (status==0)
-	break;
-      
-      // Copy
-      for (j=0;j<s.nchan;j++) 
-	s.z[i+s.nsub*j]+=z[j+j0];
+  // Start prefetch threads
+  pthread_mutex_init(&st->r.lock,NULL);
+  pthread_cond_init(&st->r.cond,NULL);
+  for (k=0;k<NTHREAD;k++)
+    pthread_create(&st->thread[k],NULL,prefetch_thread,&st->r);
 
-      // Increment
-      if (l%nbin==nbin-1) {
-	// Scale
-	s.mjd[i]/=(float) nadd;
+  return st;
+}
 
-	for (j=0;j<s.nchan;j++) 
-	  s.z[i+s.nsub*j]/=(float) nadd;
+// Open a spectrogram for reading in chunks of nchunk binned subints.
+// nsub=0 reads until the files run out; nchunk=0 reads the whole range in
+// one chunk, taking the subint count of the first file if nsub=0
+struct specstream *open_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int nchunk)
+{
+  return open_stream(prefix,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,layout,STORE_FLOAT,nchunk,0);
+}
 
-	ibin=0;
-	nadd=0;
-	i++;
-      }
-    }
+// Watch the directory of prefix for new and growing files, returns -1
+// where inotify is not available
+int watch_directory(char *prefix)
+{
+  int ifd=-1;
+#ifdef __linux__
+  char dir[256],*ptr;
 
-    // Close file
-    fclose(file);
+  strncpy(dir,prefix,sizeof(dir)-1);
+  dir[sizeof(dir)-1]='\0';
+  ptr=strrchr(dir,'/');
+  if (ptr!=NULL)
+    *ptr='\0';
+  else
+    strcpy(dir,".");
+  ifd=inotify_init1(IN_NONBLOCK);
+  if (ifd>=0 && inotify_add_watch(ifd,dir,IN_MODIFY|IN_CREATE|IN_CLOSE_WRITE|IN_MOVED_TO)<0) {
+    close(ifd);
+    ifd=-1;
   }
+#endif
 
-  // Scale last subint
-  s.mjd[i]/=(float) nadd;
+  return ifd;
+}
 
-  for (j=0;j<s.nchan;j++) 
-    s.z[i+s.nsub*j]/=(float) nadd;
+// Wait for files to grow or appear, polling without inotify
+void wait_for_data(int ifd)
+{
+#ifdef __linux__
+  char buf[4096];
+  struct pollfd pfd;
 
-  // Swap frequency range
-  if (f0>0.0 && df0>0.0) {
-    s.freq=f0;
-    s.samp_rate=df0;
+  if (ifd>=0) {
+    pfd.fd=ifd;
+    pfd.events=POLLIN;
+    if (poll(&pfd,1,FOLLOW_POLL)>0)
+      while (read(ifd,buf,sizeof(buf))>0);
+    return;
   }
+#endif
+  usleep(1000*FOLLOW_POLL);
 
-  // Compute averages
-  for (i=0;i<s.nsub;i++) {
-    s.zavg[i]=0.0;
-    for (j=0;j<s.nchan;j++) 
-      if (!isnan(s.z[i+s.nsub*j]) && !isinf(s.z[i+s.nsub*j]))
-	s.zavg[i]+=s.z[i+s.nsub*j];
-    s.zavg[i]/=(float) s.nchan;
+  return;
+}
+
+// Open a spectrogram that is still being written; next_chunk waits for
+// new subints and returns only complete bins not returned before
+struct specstream *follow_spectrogram(char *prefix,int isub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int nchunk)
+{
+  int ifd,nch,msub,nplane;
+  char filename[128];
+  double bw;
+  struct specstream *st;
+
+  // Wait for the first header
+  ifd=watch_directory(prefix);
+  sprintf(filename,"%s_%06d.bin",prefix,isub);
+  while (read_layout(filename,&nch,&msub,&nplane,&bw)==0)
+    wait_for_data(ifd);
+
+  st=open_stream(prefix,isub,0,f0,df0,nbin,fbin,reduce,foff,plane,layout,STORE_FLOAT,nchunk,1);
+  if (st==NULL) {
+    if (ifd>=0)
+      close(ifd);
+    return NULL;
   }
+  st->ifd=ifd;
 
-  // Compute deviations
-  for (i=0;i<s.nsub;i++) {
-    s.zstd[i]=0.0;
-    for (j=0;j<s.nchan;j++) 
-      if (!isnan(s.z[i+s.nsub*j]) && !isinf(s.z[i+s.nsub*j]))
-	s.zstd[i]+=pow(s.zavg[i]-s.z[i+s.nsub*j],2);
-    s.zstd[i]=sqrt(s.zstd[i]/(float) s.nchan);
+  return st;
+}
+
+// Store channels z as row i of a compact spectrogram
+void store_row(struct spectrogram *s,int i,float *z)
+{
+  int j;
+  long l;
+  float zmin,zmax,scale;
+
+  // Range of finite values
+  for (j=0,zmin=INFINITY,zmax=-INFINITY;j<s->nchan;j++) {
+    if (isnan(z[j]) || isinf(z[j]))
+      continue;
+    if (z[j]<zmin) zmin=z[j];
+    if (z[j]>zmax) zmax=z[j];
   }
+  if (zmin>zmax)
+    zmin=zmax=0.0;
 
-  // Compute limits
-  for (i=0;i<s.nsub;i++) {
-    if (i==0) {
-      s.zmin=s.zavg[i]-1.0*s.zstd[i];
-      s.zmax=s.zavg[i]+1.0*s.zstd[i];
-    } else {
-      if (s.zavg[i]-1.0*s.zstd[i]<s.zmin) s.zmin=s.zavg[i]-1.0*s.zstd[i];
-      if (s.zavg[i]+1.0*s.zstd[i]>s.zmax) s.zmax=s.zavg[i]+1.0*s.zstd[i];
+  // Half precision relative to the largest magnitude
+  if (s->store==STORE_HALF) {
+    scale=(fabs(zmin)>fabs(zmax)) ? fabs(zmin) : fabs(zmax);
+    if (scale==0.0)
+      scale=1.0;
+    s->zscale[i]=scale;
+    s->zoffset[i]=0.0;
+    for (j=0;j<s->nchan;j++) {
+      l=ZIDX(*s,i,j);
+      s->zh[l]=float_to_half(z[j]/scale);
     }
+    return;
   }
 
-  // Free 
-  free(z);
-  free(cz);
+  // 8 bits between the extremes
+  scale=(zmax-zmin)/255.0;
+  if (scale==0.0)
+    scale=1.0;
+  s->zscale[i]=scale;
+  s->zoffset[i]=zmin;
+  for (j=0;j<s->nchan;j++) {
+    l=ZIDX(*s,i,j);
+    s->zb[l]=quantize((z[j]-zmin)/scale);
+  }
 
-  return s;
+  return;
 }
 
-void write_spectrogram(struct spectrogram s,char *prefix)
+// Scale row i of the chunk by the number of added subints
+void store_bin(struct specstream *st,int i,int nadd)
 {
-  int i,j;
-  FILE *file;
-  char header[256]="",filename[256],nfd[32];
-  float *z;
-  double mjd;
+  int j;
+  struct spectrogram *s=&st->s;
 
-  // Allocate
-  z=(float *) malloc(sizeof(float)*s.nchan);
+  s->mjd[i]/=(float) nadd;
+
+  if (s->store==STORE_FLOAT) {
+    for (j=0;j<s->nchan;j++) 
+      ZVAL(*s,i,j)/=(float) nadd;
+    return;
+  }
 
-  // Generate filename
-  sprintf(filename,"%s_%06d.bin",prefix,0);
+  for (j=0;j<s->nchan;j++) 
+    st->acc[j]/=(float) nadd;
+  store_row(s,i,st->acc);
+  for (j=0;j<s->nchan;j++) 
+    st->acc[j]=0.0;
 
-  // Open file
-  file=fopen(filename,"w");
+  return;
+}
+
+// Add a subint to row i of the chunk, returns the next row to fill
+int bin_subint(struct specstream *st,int i,int *nadd,float *z,double mjd,float length)
+{
+  int j;
+  struct spectrogram *s=&st->s;
+
+  s->mjd[i]+=mjd+0.5*length/86400.0;
+  s->length[i]+=length;
+  (*nadd)++;
+
+  // Copy
+  if (s->store==STORE_FLOAT) {
+    for (j=0;j<s->nchan;j++) 
+      ZVAL(*s,i,j)+=z[j];
+  } else {
+    for (j=0;j<s->nchan;j++) 
+      st->acc[j]+=z[j];
+  }
+
+  // Increment
+  if (*nadd==st->nbin) {
+    store_bin(st,i,*nadd);
+    *nadd=0;
+    i++;
+  }
+
+  return i;
+}
+
+// Clear the chunk buffers
+void clear_chunk(struct spectrogram *s)
+{
+  long j;
+
+  if (s->store==STORE_HALF)
+    memset(s->zh,0,sizeof(uint16_t)*s->nchan*s->nsub);
+  else if (s->store==STORE_BYTE)
+    memset(s->zb,0,sizeof(uint8_t)*s->nchan*s->nsub);
+  else
+    for (j=0;j<(long) s->nchan*s->nsub;j++)
+      s->z[j]=0.0;
+  for (j=0;j<s->nsub;j++) {
+    s->mjd[j]=0.0;
+    s->length[j]=0.0;
+    if (s->store!=STORE_FLOAT) {
+      s->zscale[j]=1.0;
+      s->zoffset[j]=0.0;
+    }
+  }
+
+  return;
+}
+
+// Bin subints of files being written, waiting until at least one bin is
+// complete; returns the number of rows
+int fill_follow(struct specstream *st)
+{
+  int i,nadd,status,nch,msub,nplane;
+  char filename[128];
+  float length;
+  double mjd,bw;
+  struct spectrogram *s=&st->s;
+  struct reader *r=&st->r;
+
+  clear_chunk(s);
+  for (i=0,nadd=0;i<s->nsub;) {
+    // Open current file
+    if (st->d.file==NULL) {
+      // Files just created may lack a complete header
+      sprintf(filename,"%s_%06d.bin",r->prefix,st->k+r->isub);
+      status=(read_layout(filename,&nch,&msub,&nplane,&bw)==1) ? open_decoder(&st->d,r,filename) : 0;
+      if (status==-1) {
+	st->k++;
+	continue;
+      }
+      if (status!=1) {
+	if (i>0 && nadd==0)
+	  break;
+	wait_for_data(st->ifd);
+	continue;
+      }
+      printf("following %s\n",filename);
+    }
+
+    // Next complete subint
+    if (decode_subint(&st->d,r,st->row,&mjd,&length)==1) {
+      i=bin_subint(st,i,&nadd,st->row,mjd,length);
+      continue;
+    }
+
+    // The file is complete once the next one exists
+    sprintf(filename,"%s_%06d.bin",r->prefix,st->k+r->isub+1);
+    if (access(filename,F_OK)==0) {
+      if (decode_subint(&st->d,r,st->row,&mjd,&length)==1) {
+	i=bin_subint(st,i,&nadd,st->row,mjd,length);
+	continue;
+      }
+      close_decoder(&st->d);
+      st->k++;
+      continue;
+    }
+
+    // Return complete bins, or wait for more data
+    if (i>0 && nadd==0)
+      break;
+    wait_for_data(st->ifd);
+  }
+
+  return i;
+}
+
+// Bin the next subints into the chunk buffers, returns the number of rows
+int fill_chunk(struct specstream *st)
+{
+  int i,nadd;
+  char filename[128];
+  struct spectrogram *s=&st->s;
+  struct reader *r=&st->r;
+  struct prefetch *p;
+
+  st->nstat=0;
+  if (st->follow==1)
+    return fill_follow(st);
+  clear_chunk(s);
+
+  // Loop over files in order
+  for (i=0,nadd=0;i<s->nsub && st->end==0;) {
+    // Wait for the next piece of the file
+    if (st->p==NULL) {
+      p=&r->slot[st->k%NSLOT];
+      pthread_mutex_lock(&r->lock);
+      while (p->ready==0 || p->k!=st->k)
+	pthread_cond_wait(&r->cond,&r->lock);
+      pthread_mutex_unlock(&r->lock);
+
+      sprintf(filename,"%s_%06d.bin",r->prefix,st->k+r->isub);
+      if (p->n<0) {
+	printf("%s does not exist\n",filename);
+	st->end=1;
+	break;
+      }
+      if (p->j0==0)
+	printf("opened %s (%d%s subints, %.1f MB/s)\n",filename,p->n,(p->last==1) ? "" : "+",(p->t>0.0) ? 1e-6*p->nbyte/p->t : 0.0);
+      st->p=p;
+      st->jsub=0;
+    }
+    p=st->p;
+
+    // Bin subints, taking statistics from the sidecar
+    for (;st->jsub<p->n && i<s->nsub && (st->nsub==0 || st->l<st->nsub);st->jsub++,st->l++) {
+      if (p->j0+st->jsub<p->nstat) {
+	s->zavg[i]=p->stat[p->j0+st->jsub].zavg;
+	s->zstd[i]=p->stat[p->j0+st->jsub].zstd;
+	st->nstat++;
+      }
+      i=bin_subint(st,i,&nadd,p->z+(long) st->jsub*s->nchan,p->mjd[st->jsub],p->length[st->jsub]);
+    }
+    if (st->nsub>0 && st->l>=st->nsub)
+      st->end=1;
+
+    // Release piece, and the slot after the last piece of the file
+    if (st->jsub>=p->n || p->fatal==1) {
+      if (p->fatal==1)
+	st->end=1;
+      pthread_mutex_lock(&r->lock);
+      p->ready=0;
+      if (p->last==1) {
+	r->done++;
+	st->k++;
+      }
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->lock);
+      st->p=NULL;
+    }
+  }
+
+  // Scale last subint, if partially binned
+  if (nadd>0 && i<s->nsub) {
+    store_bin(st,i,nadd);
+    i++;
+  }
+
+  return i;
+}
+
+// Compute limits from the subint averages and deviations
+void spectrogram_limits(struct spectrogram *s)
+{
+  int i;
+
+  for (i=0;i<s->nsub;i++) {
+    if (i==0) {
+      s->zmin=s->zavg[i]-1.0*s->zstd[i];
+      s->zmax=s->zavg[i]+1.0*s->zstd[i];
+    } else {
+      if (s->zavg[i]-1.0*s->zstd[i]<s->zmin) s->zmin=s->zavg[i]-1.0*s->zstd[i];
+      if (s->zavg[i]+1.0*s->zstd[i]>s->zmax) s->zmax=s->zavg[i]+1.0*s->zstd[i];
+    }
+  }
+
+  return;
+}
+
+// Compute subint averages, deviations and limits
+void spectrogram_stats(struct spectrogram *s)
+{
+  int i,j;
+  float z;
+
+  // Compute averages
+  for (i=0;i<s->nsub;i++) {
+    s->zavg[i]=0.0;
+    for (j=0;j<s->nchan;j++) {
+      z=ZGET(*s,i,j);
+      if (!isnan(z) && !isinf(z))
+	s->zavg[i]+=z;
+    }
+    s->zavg[i]/=(float) s->nchan;
+  }
+
+  // Compute deviations
+  for (i=0;i<s->nsub;i++) {
+    s->zstd[i]=0.0;
+    for (j=0;j<s->nchan;j++) {
+      z=ZGET(*s,i,j);
+      if (!isnan(z) && !isinf(z))
+	s->zstd[i]+=pow(s->zavg[i]-z,2);
+    }
+    s->zstd[i]=sqrt(s->zstd[i]/(float) s->nchan);
+  }
+
+  // Compute limits
+  spectrogram_limits(s);
+
+  return;
+}
+
+// Read the next chunk into s, which points into buffers owned by the
+// stream and valid until the next call; returns the number of subints
+int next_chunk(struct specstream *st,struct spectrogram *s)
+{
+  int i,j,n;
+  struct spectrogram *c=&st->s;
+
+  // Restore full chunk size
+  c->nsub=st->nchunk;
+  n=fill_chunk(st);
+
+  // Close up time-fastest rows of a partial chunk
+  if (c->layout==LAYOUT_TIME && n<c->nsub)
+    for (j=1;j<c->nchan;j++)
+      for (i=0;i<n;i++)
+	c->z[i+(long) n*j]=c->z[i+(long) c->nsub*j];
+  c->nsub=n;
+
+  // Start time of the chunk
+  if (n>0)
+    mjd2nfd(c->mjd[0]-0.5*c->length[0]/86400.0,c->nfd0);
+  if (st->nstat==n)
+    spectrogram_limits(c);
+  else
+    spectrogram_stats(c);
+  *s=*c;
+
+  return n;
+}
+
+// Stop prefetching and free the stream
+void close_spectrogram(struct specstream *st)
+{
+  int k;
+
+  // Close followed file
+  if (st->follow==1) {
+    close_decoder(&st->d);
+    if (st->ifd>=0)
+      close(st->ifd);
+    free(st->row);
+  }
+
+  // Stop prefetch threads
+  if (st->follow==0) {
+    pthread_mutex_lock(&st->r.lock);
+    st->r.stop=1;
+    pthread_cond_broadcast(&st->r.cond);
+    pthread_mutex_unlock(&st->r.lock);
+    for (k=0;k<NTHREAD;k++)
+      pthread_join(st->thread[k],NULL);
+    for (k=0;k<NSLOT;k++) {
+      free(st->r.slot[k].z);
+      free(st->r.slot[k].mjd);
+      free(st->r.slot[k].length);
+      free(st->r.slot[k].znext);
+      free(st->r.slot[k].mjdnext);
+      free(st->r.slot[k].lengthnext);
+      free(st->r.slot[k].stat);
+    }
+    pthread_mutex_destroy(&st->r.lock);
+    pthread_cond_destroy(&st->r.cond);
+  }
+
+  // Free chunk
+  free_spectrogram(&st->s);
+  free(st->acc);
+  free(st);
+
+  return;
+}
+
+// Channels, subints per file, planes and bandwidth of a file, returns 0 if
+// it is absent or not a spectrogram
+int read_layout(char *filename,int *nchan,int *nsub,int *nplane,double *samp_rate)
+{
+  int status;
+  char header[256];
+  FILE *file;
+  struct textheader th;
+  struct binheader bh;
+
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return 0;
+  if (read_binheader(file,&bh)==1) {
+    *nchan=bh.nchan;
+    *nsub=bh.nsub;
+    *nplane=bh.nplane;
+    *samp_rate=bh.samp_rate;
+    fclose(file);
+    return 1;
+  }
+  memset(&th,0,sizeof(struct textheader));
+  status=fread(header,sizeof(char),256,file);
+  fclose(file);
+  if (status!=256 || parse_header(header,&th)==0)
+    return 0;
+  *nchan=th.nchan;
+  *nsub=th.nsub;
+  *nplane=th.nplane;
+  *samp_rate=th.samp_rate;
+
+  return 1;
+}
+
+// Coarsest pyramid level giving the same time and channel binning;
+// returns the prefix to read, adjusting the subint and binning counts and,
+// for maxima of channels, reading the maximum plane of the level
+char *pyramid_prefix(char *prefix,char *lprefix,int isub,int *nsub,int *nbin,int *fbin,int reduce,int *plane)
+{
+  int level,m,nch,msub,nplane,lnch,lsub,lplane,lp;
+  char filename[300];
+  double bw,lbw;
+
+  sprintf(filename,"%s_%06d.bin",prefix,isub);
+  if (*nbin==1 || *plane>PLANE_MAX || reduce==REDUCE_MEDIAN || read_layout(filename,&nch,&msub,&nplane,&bw)==0)
+    return prefix;
+  lp=(reduce==REDUCE_MAX) ? PLANE_MAX : *plane;
+  for (level=NLEVEL;level>0;level--) {
+    m=1<<level;
+    if (*nbin%m!=0 || *fbin%m!=0)
+      continue;
+    sprintf(lprefix,PYRAMID_FORMAT,prefix,level);
+    sprintf(filename,"%s_%06d.bin",lprefix,isub);
+    if (read_layout(filename,&lnch,&lsub,&lplane,&lbw)==0 || lsub*m!=msub || lnch*m!=nch || lplane<=lp)
+      continue;
+    printf("reading pyramid level %d\n",level);
+    if (*nsub>0)
+      *nsub=(*nsub/(*nbin))*(*nbin)/m;
+    *nbin/=m;
+    *fbin/=m;
+    *plane=lp;
+    return lprefix;
+  }
+
+  return prefix;
+}
+
+struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int store)
+{
+  int nstat;
+  char lprefix[256];
+  struct spectrogram s;
+  struct specstream *st;
+
+  prefix=pyramid_prefix(prefix,lprefix,isub,&nsub,&nbin,&fbin,reduce,&plane);
+
+  // Whole range as a single chunk
+  st=open_stream(prefix,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,layout,store,0,0);
+  if (st==NULL) {
+    s.nsub=0;
+    s.nchan=0;
+    return s;
+  }
+  fill_chunk(st);
+
+  // Take over the chunk buffers
+  s=st->s;
+  nstat=st->nstat;
+  st->s.z=NULL;
+  st->s.zh=NULL;
+  st->s.zb=NULL;
+  st->s.zscale=NULL;
+  st->s.zoffset=NULL;
+  st->s.zavg=NULL;
+  st->s.zstd=NULL;
+  st->s.mjd=NULL;
+  st->s.length=NULL;
+  close_spectrogram(st);
+
+  // Statistics from sidecars if they cover all subints
+  if (nstat==s.nsub)
+    spectrogram_limits(&s);
+  else
+    spectrogram_stats(&s);
+
+  return s;
+}
+
+// Read a spectrogram into tiles of a cache file, holding at most budget MB
+// of them in memory; nsub=0 reads until the files run out
+struct spectrogram page_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int budget)
+{
+  int i,j,n,fd,ti,tj,ntj=0,nalloc=0,error=0;
+  long k;
+  char lprefix[256],filename[300],*env;
+  float *tile;
+  size_t nbyte=sizeof(float)*TILE_NSUB*TILE_NCHAN;
+  struct spectrogram s,c;
+  struct specstream *st;
+  struct specpager *pg;
+
+  prefix=pyramid_prefix(prefix,lprefix,isub,&nsub,&nbin,&fbin,reduce,&plane);
+  memset(&s,0,sizeof(struct spectrogram));
+
+  // Cache file, removed once closed
+  env=getenv("TMPDIR");
+  sprintf(filename,"%s/rfcache.XXXXXX",(env!=NULL) ? env : "/tmp");
+  fd=mkstemp(filename);
+  if (fd<0) {
+    fprintf(stderr,"Failed to create cache file %s\n",filename);
+    return s;
+  }
+  unlink(filename);
+
+  // Stream rows of tiles into the cache
+  st=open_spectrogram(prefix,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_CHAN,TILE_NSUB);
+  if (st==NULL) {
+    close(fd);
+    return s;
+  }
+  tile=(float *) malloc(nbyte);
+  for (ti=0;error==0 && (n=next_chunk(st,&c))>0;ti++) {
+    if (ti==0) {
+      strcpy(s.nfd0,c.nfd0);
+      s.freq=c.freq;
+      s.samp_rate=c.samp_rate;
+      s.nchan=c.nchan;
+      ntj=(c.nchan+TILE_NCHAN-1)/TILE_NCHAN;
+    }
+
+    // Subint times and statistics stay in memory
+    if (s.nsub+n>nalloc) {
+      nalloc=(nalloc==0) ? 16*TILE_NSUB : 2*nalloc;
+      s.mjd=(double *) realloc(s.mjd,sizeof(double)*nalloc);
+      s.length=(float *) realloc(s.length,sizeof(float)*nalloc);
+      s.zavg=(float *) realloc(s.zavg,sizeof(float)*nalloc);
+      s.zstd=(float *) realloc(s.zstd,sizeof(float)*nalloc);
+    }
+    memcpy(s.mjd+s.nsub,c.mjd,sizeof(double)*n);
+    memcpy(s.length+s.nsub,c.length,sizeof(float)*n);
+    memcpy(s.zavg+s.nsub,c.zavg,sizeof(float)*n);
+    memcpy(s.zstd+s.nsub,c.zstd,sizeof(float)*n);
+    s.nsub+=n;
+
+    // Split rows into tiles, zero padded
+    for (tj=0;tj<ntj;tj++) {
+      memset(tile,0,nbyte);
+      for (i=0;i<n;i++)
+	for (j=tj*TILE_NCHAN;j<c.nchan && j<(tj+1)*TILE_NCHAN;j++)
+	  tile[i*TILE_NCHAN+j-tj*TILE_NCHAN]=c.z[(long) i*c.nchan+j];
+      if (pwrite(fd,tile,nbyte,(off_t) ((long) ti*ntj+tj)*nbyte)!=nbyte) {
+	fprintf(stderr,"Failed to write cache file\n");
+	error=1;
+	break;
+      }
+    }
+  }
+  close_spectrogram(st);
+  free(tile);
+  if (s.nsub==0 || error==1) {
+    close(fd);
+    free_spectrogram(&s);
+    memset(&s,0,sizeof(struct spectrogram));
+    return s;
+  }
+
+  // Tile slots within the memory budget
+  pg=(struct specpager *) malloc(sizeof(struct specpager));
+  pg->fd=fd;
+  pg->ntj=ntj;
+  pg->ntile=(long) ti*ntj;
+  pg->nslot=((long) budget<<20)/nbyte;
+  if (pg->nslot<2)
+    pg->nslot=2;
+  if (pg->nslot>pg->ntile)
+    pg->nslot=pg->ntile;
+  pg->nload=0;
+  pg->slast=0;
+  pg->clock=0;
+  pg->tlast=-1;
+  pg->tmiss=-1;
+  pg->map=(int *) malloc(sizeof(int)*pg->ntile);
+  for (k=0;k<pg->ntile;k++)
+    pg->map[k]=-1;
+  pg->tile=(long *) malloc(sizeof(long)*pg->nslot);
+  pg->used=(long *) malloc(sizeof(long)*pg->nslot);
+  pg->z=(float *) malloc(nbyte*pg->nslot);
+  printf("paged %d subints in %ld tiles, %d in memory\n",s.nsub,pg->ntile,pg->nslot);
+
+  s.layout=layout;
+  s.store=STORE_PAGED;
+  s.pager=pg;
+  spectrogram_limits(&s);
+
+  return s;
+}
+
+// Open output for spectrograms split into files of nsub subints with
+// nbits of 8 or -32 and version 1 or 2 containers
+struct specwriter *open_writer(char *prefix,int nsub,int nbits,int version)
+{
+  struct specwriter *w;
+
+  w=(struct specwriter *) malloc(sizeof(struct specwriter));
+  memset(w,0,sizeof(struct specwriter));
+  strncpy(w->prefix,prefix,sizeof(w->prefix)-1);
+  w->nsub=nsub;
+  w->nbits=nbits;
+  w->version=version;
+
+  return w;
+}
+
+// Close the current output file, appending the index of indexed files
+// and setting the subint count of 256 byte headers
+void close_output(struct specwriter *w)
+{
+  if (w->file==NULL)
+    return;
+  if (w->version==2 && w->n>0)
+    write_index(w->file,&w->bh,w->offset,w->n);
+  else if (w->version==1)
+    patch_nsub(w->file,w->offset,w->n);
+  fclose(w->file);
+  w->file=NULL;
+
+  return;
+}
+
+// Start the next output file for subints of s
+int next_output(struct specwriter *w,struct spectrogram *s)
+{
+  char filename[300];
+  int32_t win[2]={0,0};
+
+  close_output(w);
+  sprintf(filename,"%s_%06d.bin",w->prefix,w->k);
+  w->file=fopen(filename,"w+");
+  if (w->file==NULL) {
+    fprintf(stderr,"Failed to open %s\n",filename);
+    return -1;
+  }
+  w->k++;
+  w->n=0;
+
+  // Buffers
+  w->z=(float *) realloc(w->z,sizeof(float)*s->nchan);
+  w->cz=(char *) realloc(w->cz,sizeof(char)*s->nchan);
+  w->offset=(int64_t *) realloc(w->offset,sizeof(int64_t)*w->nsub);
+
+  // Indexed files start with the layout
+  if (w->version==2) {
+    memset(&w->bh,0,sizeof(struct binheader));
+    w->bh.freq=s->freq;
+    w->bh.samp_rate=s->samp_rate;
+    w->bh.nchan=s->nchan;
+    w->bh.nbits=w->nbits;
+    w->bh.nplane=1;
+    w->bh.nwin=0;
+    w->bh.nstore=s->nchan;
+    write_binheader(w->file,&w->bh,win);
+  }
+
+  return 0;
+}
+
+// Append the subints of s
+int write_chunk(struct specwriter *w,struct spectrogram s)
+{
+  int i,j;
+  char header[256],nfd[32];
+  float *z,zs,zavg=0.0,zstd=1.0;
+  double mjd;
+  struct subheader sh;
 
-  // Loop over subints
   for (i=0;i<s.nsub;i++) {
-    // Date
+    if ((w->file==NULL || w->n>=w->nsub) && next_output(w,&s)<0)
+      return -1;
+
+    // Start time
     mjd=s.mjd[i]-0.5*s.length[i]/86400.0;
-    mjd2nfd(mjd,nfd);
+    z=subint_span(&s,i,w->z);
+
+    // Scale to bytes
+    if (w->nbits==8) {
+      for (j=0,zavg=0.0;j<s.nchan;j++)
+	zavg+=z[j];
+      zavg/=(float) s.nchan;
+      for (j=0,zstd=0.0;j<s.nchan;j++)
+	zstd+=(z[j]-zavg)*(z[j]-zavg);
+      zstd=sqrt(zstd/(float) s.nchan);
+      for (j=0;j<s.nchan;j++) {
+	zs=256.0/6.0*(z[j]-zavg)/zstd;
+	if (zs<-128.0)
+	  zs=-128.0;
+	if (zs>127.0)
+	  zs=127.0;
+	w->cz[j]=(char) zs;
+      }
+    }
+
+    // Subint header
+    w->offset[w->n]=ftell(w->file);
+    if (w->version==2) {
+      sh.tns=llround(mjd*86400e9);
+      sh.length=s.length[i];
+      sh.zavg=(w->nbits==8) ? zavg : 0.0;
+      sh.zstd=(w->nbits==8) ? zstd : 0.0;
+      sh.navg=0;
+      fwrite(&sh,sizeof(struct subheader),1,w->file);
+    } else {
+      // Start time, rounded to the nearest millisecond
+      memset(header,0,sizeof(header));
+      mjd2nfd(mjd+0.0005/86400.0,nfd);
+      if (w->nbits==8)
+	sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNBITS         8\nMEAN         %e\nRMS          %e\nEND\n",nfd,s.freq,s.samp_rate,s.length[i],s.nchan,w->nsub,zavg,zstd);
+      else
+	sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nEND\n",nfd,s.freq,s.samp_rate,s.length[i],s.nchan,w->nsub);
+      fwrite(header,sizeof(char),256,w->file);
+    }
+
+    // Data
+    if (w->nbits==8)
+      fwrite(w->cz,sizeof(char),s.nchan,w->file);
+    else
+      fwrite(z,sizeof(float),s.nchan,w->file);
+    w->n++;
+  }
+
+  return 0;
+}
+
+// Close output and free the writer
+void close_writer(struct specwriter *w)
+{
+  close_output(w);
+  free(w->z);
+  free(w->cz);
+  free(w->offset);
+  free(w);
+
+  return;
+}
+
+void write_spectrogram(struct spectrogram s,char *prefix)
+{
+  struct specwriter *w;
+
+  // Dump subints to a single file
+  w=open_writer(prefix,s.nsub,-32,1);
+  write_chunk(w,s);
+  close_writer(w);
+
+  return;
+}
+
+int read_binheader(FILE *file,struct binheader *h)
+{
+  int status;
+  long pos;
+
+  status=fread(h,sizeof(struct binheader),1,file);
+  if (status!=1 || memcmp(h->magic,V2_MAGIC,8)!=0 || h->version!=2) {
+    rewind(file);
+    return 0;
+  }
+
+  // Count subints of files that were not closed properly
+  if (h->index==0) {
+    pos=ftell(file);
+    fseek(file,0,SEEK_END);
+    h->nsub=(ftell(file)-subint_offset(file,h,0))/(subint_offset(file,h,1)-subint_offset(file,h,0));
+    fseek(file,pos,SEEK_SET);
+  }
+
+  return 1;
+}
+
+// Write indexed container header and window table
+void write_binheader(FILE *file,struct binheader *h,int32_t *win)
+{
+  memcpy(h->magic,V2_MAGIC,8);
+  h->version=2;
+  h->nsub=0;
+  h->index=0;
+  fwrite(h,sizeof(struct binheader),1,file);
+  if (h->nwin>0)
+    fwrite(win,sizeof(int32_t),2*h->nwin,file);
+
+  return;
+}
+
+// Offset of subint isub, from the index if present
+int64_t subint_offset(FILE *file,struct binheader *h,int64_t isub)
+{
+  int64_t offset;
+  long nbyte;
+
+  if (h->index>0 && isub<h->nsub) {
+    fseek(file,h->index+isub*sizeof(int64_t),SEEK_SET);
+    if (fread(&offset,sizeof(int64_t),1,file)==1)
+      return offset;
+  }
+
+  // Subints have a fixed size
+  nbyte=(h->nbits==8) ? sizeof(char) : sizeof(float);
+  return sizeof(struct binheader)+2*h->nwin*sizeof(int32_t)+isub*(sizeof(struct subheader)+(int64_t) h->nplane*h->nstore*nbyte);
+}
+
+// Append the subint index and update the header
+void write_index(FILE *file,struct binheader *h,int64_t *offset,int64_t nsub)
+{
+  fseek(file,0,SEEK_END);
+  h->index=ftell(file);
+  h->nsub=nsub;
+  fwrite(offset,sizeof(int64_t),nsub,file);
+  fseek(file,0,SEEK_SET);
+  fwrite(h,sizeof(struct binheader),1,file);
+  fseek(file,0,SEEK_END);
 
-    // Generate header
-    sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nEND\n",nfd,s.freq,s.samp_rate,s.length[i],s.nchan);
+  return;
+}
+
+// Replace the NSUB value of a null-terminated 256 byte header, returns -1
+// if it is absent
+int set_nsub(char *header,int nsub)
+{
+  char *ptr,*end,text[256];
+
+  ptr=strstr(header,"NSUB");
+  if (ptr==NULL || (end=strchr(ptr,'\n'))==NULL)
+    return -1;
+  sprintf(text,"NSUB         %d%s",nsub,end);
+  if ((ptr-header)+strlen(text)>=256)
+    return -1;
+  strcpy(ptr,text);
+
+  return 0;
+}
 
-    // Copy buffer
-    for (j=0;j<s.nchan;j++) 
-      z[j]=s.z[i+s.nsub*j];
+// Set NSUB of the 256 byte headers at offset to the nsub subints written,
+// the file being open for update
+void patch_nsub(FILE *file,int64_t *offset,int nsub)
+{
+  int i;
+  char header[257];
 
-    // Dump contents
+  for (i=0;i<nsub;i++) {
+    fseek(file,offset[i],SEEK_SET);
+    if (fread(header,sizeof(char),256,file)!=256)
+      break;
+    header[256]='\0';
+    if (set_nsub(header,nsub)<0)
+      continue;
+    fseek(file,offset[i],SEEK_SET);
     fwrite(header,sizeof(char),256,file);
-    fwrite(z,sizeof(float),s.nchan,file);
   }
+  fseek(file,0,SEEK_END);
 
-  // Close file
+  return;
+}
+
+// Tile t of a paged spectrogram, loaded on a miss in place of the least
+// recently used one
+float *page_tile(struct specpager *pg,long t)
+{
+  int k,kmin;
+  long dt;
+  size_t nbyte=sizeof(float)*TILE_NSUB*TILE_NCHAN;
+
+  // Same tile as the last access
+  if (t==pg->tlast) {
+    pg->used[pg->slast]=++pg->clock;
+    return pg->z+(long) pg->slast*TILE_NSUB*TILE_NCHAN;
+  }
+
+  k=pg->map[t];
+  if (k<0) {
+    // Empty slot, else evict
+    if (pg->nload<pg->nslot) {
+      k=pg->nload++;
+    } else {
+      for (k=1,kmin=0;k<pg->nslot;k++)
+	if (pg->used[k]<pg->used[kmin])
+	  kmin=k;
+      k=kmin;
+      pg->map[pg->tile[k]]=-1;
+    }
+    if (pread(pg->fd,pg->z+(long) k*TILE_NSUB*TILE_NCHAN,nbyte,(off_t) t*nbyte)!=nbyte) {
+      fprintf(stderr,"Failed to read tile %ld from cache file\n",t);
+      memset(pg->z+(long) k*TILE_NSUB*TILE_NCHAN,0,nbyte);
+    }
+    pg->map[t]=k;
+    pg->tile[k]=t;
+
+    // Read ahead along channels or subints when misses are adjacent
+    dt=t-pg->tmiss;
+#ifdef POSIX_FADV_WILLNEED
+    if ((labs(dt)==1 || labs(dt)==pg->ntj) && t+dt>=0 && t+dt<pg->ntile)
+      posix_fadvise(pg->fd,(off_t) (t+dt)*nbyte,nbyte,POSIX_FADV_WILLNEED);
+#endif
+    pg->tmiss=t;
+  }
+  pg->used[k]=++pg->clock;
+  pg->tlast=t;
+  pg->slast=k;
+
+  return pg->z+(long) k*TILE_NSUB*TILE_NCHAN;
+}
+
+// Channels of subint i, in place for channel-fastest spectrograms, else gathered into buf
+float *subint_span(struct spectrogram *s,int i,float *buf)
+{
+  int j;
+  long l;
+  float scale,offset,*z;
+
+  if (s->store==STORE_FLOAT) {
+    if (s->layout==LAYOUT_CHAN)
+      return s->z+(long) i*s->nchan;
+    for (j=0;j<s->nchan;j++)
+      buf[j]=s->z[i+(long) s->nsub*j];
+    return buf;
+  }
+
+  // Copy from tiles
+  if (s->store==STORE_PAGED) {
+    for (j=0;j<s->nchan;j+=TILE_NCHAN) {
+      z=page_tile(s->pager,(long) (i/TILE_NSUB)*s->pager->ntj+j/TILE_NCHAN)+(i%TILE_NSUB)*TILE_NCHAN;
+      memcpy(buf+j,z,sizeof(float)*((j+TILE_NCHAN<=s->nchan) ? TILE_NCHAN : s->nchan-j));
+    }
+    return buf;
+  }
+
+  // Decode compact row
+  scale=s->zscale[i];
+  offset=s->zoffset[i];
+  if (s->layout==LAYOUT_CHAN) {
+    l=(long) i*s->nchan;
+    if (s->store==STORE_HALF)
+      for (j=0;j<s->nchan;j++)
+	buf[j]=half_to_float(s->zh[l+j])*scale;
+    else
+      for (j=0;j<s->nchan;j++)
+	buf[j]=(float) s->zb[l+j]*scale+offset;
+  } else {
+    if (s->store==STORE_HALF)
+      for (j=0;j<s->nchan;j++)
+	buf[j]=half_to_float(s->zh[i+(long) s->nsub*j])*scale;
+    else
+      for (j=0;j<s->nchan;j++)
+	buf[j]=(float) s->zb[i+(long) s->nsub*j]*scale+offset;
+  }
+
+  return buf;
+}
+
+// Subints of channel j, in place for time-fastest spectrograms, else gathered into buf
+float *channel_span(struct spectrogram *s,int j,float *buf)
+{
+  int i;
+
+  if (s->store==STORE_FLOAT) {
+    if (s->layout==LAYOUT_TIME)
+      return s->z+(long) s->nsub*j;
+    for (i=0;i<s->nsub;i++)
+      buf[i]=s->z[(long) i*s->nchan+j];
+    return buf;
+  }
+  if (s->layout==LAYOUT_TIME || s->store==STORE_PAGED)
+    return channel_block(s,j,1,buf);
+  for (i=0;i<s->nsub;i++)
+    buf[i]=zvalue(s,i,j);
+
+  return buf;
+}
+
+// Time-fastest block of n channels from channel j0, in place for float
+// time-fastest spectrograms, else decoded into buf of nsub*n values
+float *channel_block(struct spectrogram *s,int j0,int n,float *buf)
+{
+  int i,j;
+  long l;
+  uint16_t *zh;
+  uint8_t *zb;
+  float *zs=s->zscale,*zo=s->zoffset,*b;
+
+  if (s->store==STORE_FLOAT && s->layout==LAYOUT_TIME)
+    return s->z+(long) s->nsub*j0;
+
+  // Gather from tiles, a row of tiles at a time
+  if (s->store==STORE_PAGED) {
+    for (i=0;i<s->nsub;i+=TILE_NSUB) {
+      for (j=j0;j<j0+n;j++) {
+	b=page_tile(s->pager,(long) (i/TILE_NSUB)*s->pager->ntj+j/TILE_NCHAN)+j%TILE_NCHAN;
+	for (l=i;l<i+TILE_NSUB && l<s->nsub;l++)
+	  buf[l+(long) s->nsub*(j-j0)]=b[(l-i)*TILE_NCHAN];
+      }
+    }
+    return buf;
+  }
+  if (s->layout==LAYOUT_CHAN) {
+    for (j=0;j<n;j++)
+      for (i=0;i<s->nsub;i++)
+	buf[i+(long) s->nsub*j]=ZGET(*s,i,j0+j);
+    return buf;
+  }
+
+  // Decode channel by channel, contiguous in subints
+  for (j=0;j<n;j++) {
+    l=(long) s->nsub*(j0+j);
+    b=buf+(long) s->nsub*j;
+    if (s->store==STORE_HALF) {
+      zh=s->zh+l;
+      for (i=0;i<s->nsub;i++)
+	b[i]=half_to_float(zh[i])*zs[i];
+    } else {
+      zb=s->zb+l;
+      for (i=0;i<s->nsub;i++)
+	b[i]=(float) zb[i]*zs[i]+zo[i];
+    }
+  }
+
+  return buf;
+}
+
+// Value of subint i and channel j of a compact spectrogram
+float zvalue(struct spectrogram *s,int i,int j)
+{
+  long l=ZIDX(*s,i,j);
+
+  if (s->store==STORE_PAGED)
+    return page_tile(s->pager,(long) (i/TILE_NSUB)*s->pager->ntj+j/TILE_NCHAN)[(i%TILE_NSUB)*TILE_NCHAN+j%TILE_NCHAN];
+  if (s->store==STORE_HALF)
+    return half_to_float(s->zh[l])*s->zscale[i];
+  if (s->store==STORE_BYTE)
+    return (float) s->zb[l]*s->zscale[i]+s->zoffset[i];
+
+  return s->z[l];
+}
+
+// Free the buffers of a spectrogram
+void free_spectrogram(struct spectrogram *s)
+{
+  if (s->pager!=NULL) {
+    close(s->pager->fd);
+    free(s->pager->map);
+    free(s->pager->tile);
+    free(s->pager->used);
+    free(s->pager->z);
+    free(s->pager);
+  }
+  free(s->z);
+  free(s->zh);
+  free(s->zb);
+  free(s->zscale);
+  free(s->zoffset);
+  free(s->zavg);
+  free(s->zstd);
+  free(s->mjd);
+  free(s->length);
+
+  return;
+}
+
+// Layout and times of the first and last subints of a file; status is
+// 1 if both were read and 0 otherwise
+void sample_file(struct fileinfo *f)
+{
+  int i,nbyte,nstore;
+  char header[256];
+  int32_t *win;
+  int64_t offset,subsize;
+  FILE *file;
+  struct binheader bh;
+  struct subheader sh;
+  struct textheader th;
+
+  f->status=0;
+  file=fopen(f->name,"r");
+  if (file==NULL)
+    return;
+
+  // Indexed files
+  if (read_binheader(file,&bh)==1) {
+    f->version=2;
+    f->freq=bh.freq;
+    f->samp_rate=bh.samp_rate;
+    f->nchan=bh.nchan;
+    f->nbits=bh.nbits;
+    f->nplane=bh.nplane;
+    f->nsub=bh.nsub;
+    nbyte=(bh.nbits==8) ? sizeof(char) : sizeof(float);
+    subsize=sizeof(struct subheader)+(int64_t) bh.nplane*bh.nstore*nbyte;
+    offset=subint_offset(file,&bh,0);
+    f->truncated=(bh.index==0 || bh.index!=offset+bh.nsub*subsize || f->size!=bh.index+bh.nsub*sizeof(int64_t));
+
+    // Complete subints of files cut short after closing
+    if (f->truncated==1 && f->size<offset+f->nsub*subsize)
+      f->nsub=(f->size-offset)/subsize;
+    if (f->nsub>0) {
+      fseek(file,subint_offset(file,&bh,0),SEEK_SET);
+      if (fread(&sh,sizeof(struct subheader),1,file)==1) {
+	f->mjd0=(double) sh.tns/86400e9;
+	f->length=sh.length;
+	fseek(file,subint_offset(file,&bh,f->nsub-1),SEEK_SET);
+	if (fread(&sh,sizeof(struct subheader),1,file)==1) {
+	  f->mjd1=(double) sh.tns/86400e9+sh.length/86400.0;
+	  f->status=1;
+	}
+      }
+    }
+    fclose(file);
+    return;
+  }
+
+  // Headers of 256 bytes, subint size from the first one
+  memset(&th,0,sizeof(struct textheader));
+  if (fread(header,sizeof(char),256,file)!=256 || parse_header(header,&th)==0) {
+    fclose(file);
+    return;
+  }
+  f->version=1;
+  f->freq=th.freq;
+  f->samp_rate=th.samp_rate;
+  f->nchan=th.nchan;
+  f->nbits=th.nbits;
+  f->nplane=th.nplane;
+  f->length=th.length;
+  f->mjd0=th.mjd;
+  nstore=th.nchan;
+  if (th.nwin>0) {
+    win=(int32_t *) malloc(sizeof(int32_t)*2*th.nwin);
+    if (fread(win,sizeof(int32_t),2*th.nwin,file)!=2*th.nwin) {
+      free(win);
+      fclose(file);
+      return;
+    }
+    for (i=0,nstore=0;i<th.nwin;i++)
+      nstore+=win[2*i+1];
+    free(win);
+  }
+  nbyte=(th.nbits==8) ? sizeof(char) : sizeof(float);
+  subsize=256+2*th.nwin*sizeof(int32_t)+(int64_t) th.nplane*nstore*nbyte;
+  f->nsub=f->size/subsize;
+  f->truncated=(f->size%subsize!=0);
+
+  // Last complete subint
+  offset=(int64_t) (f->nsub-1)*subsize;
+  fseek(file,offset,SEEK_SET);
+  if (f->nsub>0 && fread(header,sizeof(char),256,file)==256 && parse_header(header,&th)==1) {
+    f->mjd1=th.mjd+th.length/86400.0;
+    f->status=1;
+  }
   fclose(file);
 
-  // Free
-  free(z);
+  return;
+}
+
+// Files shared by the sampling threads
+struct filelist {
+  struct fileinfo *f;
+  int n,next;
+  pthread_mutex_t lock;
+};
+
+static void *sample_thread(void *arg)
+{
+  int i;
+  struct filelist *fl=(struct filelist *) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&fl->lock);
+    i=fl->next++;
+    pthread_mutex_unlock(&fl->lock);
+    if (i>=fl->n)
+      break;
+    if (fl->f[i].status<0)
+      sample_file(&fl->f[i]);
+  }
+
+  return NULL;
+}
+
+// Sample the files not sampled yet (status<0) with nthread threads,
+// returns the number sampled
+int sample_files(struct fileinfo *f,int n,int nthread)
+{
+  int i,nsample;
+  struct filelist fl;
+  pthread_t *thread;
+
+  for (i=0,nsample=0;i<n;i++)
+    if (f[i].status<0)
+      nsample++;
+  if (nsample==0)
+    return 0;
+
+  fl.f=f;
+  fl.n=n;
+  fl.next=0;
+  pthread_mutex_init(&fl.lock,NULL);
+  thread=(pthread_t *) malloc(sizeof(pthread_t)*nthread);
+  for (i=0;i<nthread;i++)
+    pthread_create(&thread[i],NULL,sample_thread,&fl);
+  for (i=0;i<nthread;i++)
+    pthread_join(thread[i],NULL);
+  pthread_mutex_destroy(&fl.lock);
+  free(thread);
+
+  return nsample;
+}
+
+// Split name_NNNNNN.bin into its series base and file number, returns 0
+// if the name does not match
+int series_name(char *name,int *k)
+{
+  int i,n=strlen(name);
+
+  if (n<12 || strcmp(name+n-4,".bin")!=0 || name[n-11]!='_')
+    return 0;
+  for (i=n-10;i<n-4;i++)
+    if (name[i]<'0' || name[i]>'9')
+      return 0;
+  *k=atoi(name+n-10);
+
+  return n-11;
+}
+
+// Pyramid sidecars written by rfpyramid end in .L<level>
+int is_pyramid(char *base,int n)
+{
+  int i;
+
+  for (i=n-1;i>0 && base[i]>='0' && base[i]<='9';i--);
+
+  return (i<n-1 && i>0 && base[i]=='L' && base[i-1]=='.');
+}
+
+// Order files by series, then by number
+int compare_files(const void *a,const void *b)
+{
+  const struct fileinfo *fa=(const struct fileinfo *) a,*fb=(const struct fileinfo *) b;
+  int status;
+
+  status=strncmp(fa->name,fb->name,(fa->base<fb->base) ? fa->base : fb->base);
+  if (status!=0)
+    return status;
+  if (fa->base!=fb->base)
+    return fa->base-fb->base;
+
+  return fa->k-fb->k;
+}
+
+// Add the files of series base in directory dir, or of all series if
+// base is NULL, descending into subdirectories if recurse is set; files
+// are added unsampled
+void scan_directory(char *dir,char *base,int recurse,struct fileinfo **f,int *n,int *nalloc)
+{
+  int k,m,dfd;
+  char path[1024];
+  DIR *d;
+  struct dirent *e;
+  struct stat st;
+
+  d=opendir(dir);
+  if (d==NULL) {
+    fprintf(stderr,"Failed to open %s\n",dir);
+    return;
+  }
+  dfd=dirfd(d);
+  while ((e=readdir(d))!=NULL) {
+    if (e->d_name[0]=='.')
+      continue;
+    m=series_name(e->d_name,&k);
+
+    // Subdirectories, without following links
+    if (m==0) {
+      if (recurse==1 && fstatat(dfd,e->d_name,&st,AT_SYMLINK_NOFOLLOW)==0 && S_ISDIR(st.st_mode)) {
+	snprintf(path,sizeof(path),"%s/%s",dir,e->d_name);
+	scan_directory(path,base,recurse,f,n,nalloc);
+      }
+      continue;
+    }
+    if (base!=NULL && (m!=strlen(base) || strncmp(e->d_name,base,m)!=0))
+      continue;
+    if (base==NULL && is_pyramid(e->d_name,m))
+      continue;
+    if (fstatat(dfd,e->d_name,&st,0)!=0 || !S_ISREG(st.st_mode))
+      continue;
+
+    // Grow list
+    if (*n>=*nalloc) {
+      *nalloc=(*nalloc==0) ? 1024 : 2*(*nalloc);
+      *f=(struct fileinfo *) realloc(*f,sizeof(struct fileinfo)*(*nalloc));
+    }
+    snprintf(path,sizeof(path),"%s/%s",dir,e->d_name);
+    memset(&(*f)[*n],0,sizeof(struct fileinfo));
+    (*f)[*n].name=strdup(strcmp(dir,".")==0 ? e->d_name : path);
+    (*f)[*n].base=strlen((*f)[*n].name)-11;
+    (*f)[*n].k=k;
+    (*f)[*n].status=-1;
+    (*f)[*n].size=st.st_size;
+    (*f)[*n].mtime=st.st_mtime;
+    (*n)++;
+  }
+  closedir(d);
+
+  return;
+}
+
+// Read an archive index, returns 0 if it is missing or invalid
+int read_archive(char *filename,struct archive *a)
+{
+  int i;
+  long nbyte;
+  FILE *file;
+  struct indexheader h;
+
+  memset(a,0,sizeof(struct archive));
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return 0;
+  if (fread(&h,sizeof(struct indexheader),1,file)!=1 || strncmp(h.magic,INDEX_MAGIC,8)!=0 || h.nseries<0 || h.nfile<0 || h.nbyte<0) {
+    fclose(file);
+    return 0;
+  }
+
+  // Prefixes, then entries
+  a->nseries=h.nseries;
+  a->nfile=h.nfile;
+  nbyte=h.nbyte;
+  a->names=(char *) malloc(nbyte+1);
+  a->prefix=(char **) malloc(sizeof(char *)*(a->nseries+1));
+  a->e=(struct indexentry *) malloc(sizeof(struct indexentry)*(a->nfile+1));
+  if (fread(a->names,sizeof(char),nbyte,file)!=nbyte || fread(a->e,sizeof(struct indexentry),a->nfile,file)!=a->nfile) {
+    fclose(file);
+    free_archive(a);
+    return 0;
+  }
+  fclose(file);
+  a->names[nbyte]='\0';
+  for (i=0,nbyte=0;i<a->nseries;i++) {
+    a->prefix[i]=a->names+nbyte;
+    nbyte+=strlen(a->prefix[i])+1;
+  }
+  for (i=0;i<a->nfile;i++) {
+    if (a->e[i].series<0 || a->e[i].series>=a->nseries) {
+      free_archive(a);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Write an archive index through a temporary file, so readers never see
+// a partial index; returns 0 on failure
+int write_archive(char *filename,struct archive *a)
+{
+  int i;
+  char tmpname[1024];
+  FILE *file;
+  struct indexheader h;
+
+  memset(&h,0,sizeof(struct indexheader));
+  memcpy(h.magic,INDEX_MAGIC,8);
+  h.nseries=a->nseries;
+  h.nfile=a->nfile;
+  for (i=0;i<a->nseries;i++)
+    h.nbyte+=strlen(a->prefix[i])+1;
+
+  snprintf(tmpname,sizeof(tmpname),"%s.tmp",filename);
+  file=fopen(tmpname,"w");
+  if (file==NULL)
+    return 0;
+  fwrite(&h,sizeof(struct indexheader),1,file);
+  for (i=0;i<a->nseries;i++)
+    fwrite(a->prefix[i],sizeof(char),strlen(a->prefix[i])+1,file);
+  fwrite(a->e,sizeof(struct indexentry),a->nfile,file);
+  if (fclose(file)!=0 || rename(tmpname,filename)!=0) {
+    unlink(tmpname);
+    return 0;
+  }
+
+  return 1;
+}
+
+void free_archive(struct archive *a)
+{
+  free(a->names);
+  free(a->prefix);
+  free(a->e);
+  memset(a,0,sizeof(struct archive));
 
   return;
 }
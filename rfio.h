@@ -1,11 +1,161 @@
+#include <stdint.h>
+
+// Planes stored by rffft -M
+#define PLANE_MEAN 0
+#define PLANE_MAX 1
+#define PLANE_VAR 2
+
+// Indexed container, fields in host (little endian) byte order
+#define V2_MAGIC "STRFBIN2"
+struct binheader {
+  char magic[8];
+  int32_t version,nchan,nbits,nplane,nwin,nstore;
+  double freq,samp_rate;
+  int64_t nsub,index;
+};
+struct subheader {
+  int64_t tns;
+  float length,zavg,zstd;
+  int32_t navg;
+};
+
+// Parsed 256 byte header; fields that vary between subints are reparsed
+// in place while the remaining text matches the cached header
+#define NFIELD 5
+struct textheader {
+  char nfd[32],text[257];
+  double mjd,freq,samp_rate;
+  float length,zavg,zstd;
+  int nchan,nsub,nbits,nwin,nplane,navg;
+  int nfield,field[NFIELD],pos[NFIELD],len[NFIELD];
+};
+
+// Pyramid sidecars written by rfpyramid: level L halves time and
+// frequency resolution L times and stores mean and maximum planes
+#define NLEVEL 8
+#define PYRAMID_FORMAT "%s.L%d"
+
+// Statistics sidecar written by rffft -z, one record per subint of the
+// mean plane as decoded; hist counts channels in unit zstd bins starting
+// at zmed-HIST_OFFSET*zstd, with outliers in the end bins
+#define STATS_FORMAT "%s_%06d.stats"
+#define NHIST 16
+#define HIST_OFFSET 4
+struct substats {
+  float zavg,zstd,zmed,zmax;
+  int32_t nchan,hist[NHIST];
+};
+
+// File of a series as summarized by rfinfo and rfindex, with layout and
+// times from its first and last subint; status is -1 until sampled
+struct fileinfo {
+  char *name;
+  int base,k,status,version,nsub,nchan,nbits,nplane,truncated;
+  long size,mtime;
+  double freq,samp_rate,mjd0,mjd1;
+  float length;
+};
+
+// Archive index written by rfindex: header, series prefixes as
+// consecutive null-terminated strings, then an entry per file ordered by
+// prefix and file number; unreadable files have version 0
+#define INDEX_MAGIC "RFINDEX1"
+#define INDEX_NAME "rfindex.idx"
+struct indexheader {
+  char magic[8];
+  int32_t nseries,nfile;
+  int64_t nbyte;
+};
+struct indexentry {
+  double mjd0,mjd1,freq,samp_rate;
+  int64_t size,mtime;
+  int32_t series,k,nsub,nchan;
+  float length;
+  int8_t version,nbits,nplane,truncated;
+};
+struct archive {
+  int nseries,nfile;
+  char *names,**prefix;
+  struct indexentry *e;
+};
+
+// Reductions over binned channels
+#define REDUCE_MEAN 0
+#define REDUCE_MAX 1
+#define REDUCE_MEDIAN 2
+
+// Spectrogram layouts, cpgimag needs time-fastest
+#define LAYOUT_TIME 0
+#define LAYOUT_CHAN 1
+
+// In-memory storage of values; compact forms scale each subint, float16
+// relative to its largest value and 8-bit between its extremes, paged
+// spectrograms load tiles from a cache file on demand
+#define STORE_FLOAT 0
+#define STORE_HALF 1
+#define STORE_BYTE 2
+#define STORE_PAGED 3
+#define PAGE_BUDGET 256 // Default memory budget for paged tiles (MB)
+
+struct specpager;
+
 struct spectrogram {
-  int nsub,nchan;
+  int nsub,nchan,layout,store;
   double *mjd;
   double freq,samp_rate;
   float *length;
   float *z,*zavg,*zstd;
+  uint16_t *zh;
+  uint8_t *zb;
+  float *zscale,*zoffset;
+  struct specpager *pager;
   float zmin,zmax;
   char nfd0[32];
 };
-struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,double foff);
+
+// Chunked reader and writer, opaque to callers
+struct specstream;
+struct specwriter;
+#define FOLLOW_POLL 1000 // Longest wait for new data when following (ms)
+
+// Value of subint i, channel j
+#define ZIDX(s,i,j) ((s).layout==LAYOUT_CHAN ? (long) (i)*(s).nchan+(j) : (i)+(long) (s).nsub*(j))
+#define ZVAL(s,i,j) ((s).z[ZIDX(s,i,j)])
+#define ZGET(s,i,j) ((s).store==STORE_FLOAT ? ZVAL(s,i,j) : zvalue(&(s),i,j))
+
+struct spectrogram read_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int store);
+struct spectrogram page_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int budget);
+struct specstream *open_spectrogram(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int nchunk);
+struct specstream *follow_spectrogram(char *prefix,int isub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane,int layout,int nchunk);
+int next_chunk(struct specstream *st,struct spectrogram *s);
+void close_spectrogram(struct specstream *st);
+float *subint_span(struct spectrogram *s,int i,float *buf);
+float *channel_span(struct spectrogram *s,int j,float *buf);
+float *channel_block(struct spectrogram *s,int j0,int n,float *buf);
+float zvalue(struct spectrogram *s,int i,int j);
+void free_spectrogram(struct spectrogram *s);
+void spectrogram_limits(struct spectrogram *s);
+char *pyramid_prefix(char *prefix,char *lprefix,int isub,int *nsub,int *nbin,int *fbin,int reduce,int *plane);
 void write_spectrogram(struct spectrogram s,char *prefix);
+struct specwriter *open_writer(char *prefix,int nsub,int nbits,int version);
+int write_chunk(struct specwriter *w,struct spectrogram s);
+void close_writer(struct specwriter *w);
+int parse_header(char *header,struct textheader *h);
+void subint_stats(float *z,int n,struct substats *ss,float *buf);
+struct substats *read_stats(char *prefix,int k,int *nstat);
+int read_layout(char *filename,int *nchan,int *nsub,int *nplane,double *samp_rate);
+int read_binheader(FILE *file,struct binheader *h);
+void write_binheader(FILE *file,struct binheader *h,int32_t *win);
+int64_t subint_offset(FILE *file,struct binheader *h,int64_t isub);
+void write_index(FILE *file,struct binheader *h,int64_t *offset,int64_t nsub);
+int set_nsub(char *header,int nsub);
+void patch_nsub(FILE *file,int64_t *offset,int nsub);
+void sample_file(struct fileinfo *f);
+int sample_files(struct fileinfo *f,int n,int nthread);
+int series_name(char *name,int *k);
+int is_pyramid(char *base,int n);
+int compare_files(const void *a,const void *b);
+void scan_directory(char *dir,char *base,int recurse,struct fileinfo **f,int *n,int *nalloc);
+int read_archive(char *filename,struct archive *a);
+int write_archive(char *filename,struct archive *a);
+void free_archive(struct archive *a);
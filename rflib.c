@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "rftime.h"
+#include "rfio.h"
+#include "rflib.h"
+
+#define NCHUNK 1024 // Subints read per chunk
+
+int rf_api_version(void)
+{
+  return RF_API_VERSION;
+}
+
+// Read binned subints into a channel-fastest spectrogram; nsub=0 reads
+// until the files run out. Returns NULL if nothing could be read
+struct spectrogram *rf_read(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane)
+{
+  int n,nalloc=0;
+  char lprefix[256];
+  struct spectrogram *s,c;
+  struct specstream *st;
+
+  prefix=pyramid_prefix(prefix,lprefix,isub,&nsub,&nbin,&fbin,reduce,&plane);
+  st=open_spectrogram(prefix,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_CHAN,NCHUNK);
+  if (st==NULL)
+    return NULL;
+  s=(struct spectrogram *) calloc(1,sizeof(struct spectrogram));
+
+  // Append chunks
+  while ((n=next_chunk(st,&c))>0) {
+    if (s->nsub==0) {
+      strcpy(s->nfd0,c.nfd0);
+      s->freq=c.freq;
+      s->samp_rate=c.samp_rate;
+      s->nchan=c.nchan;
+      s->layout=LAYOUT_CHAN;
+      s->store=STORE_FLOAT;
+    }
+    if (s->nsub+n>nalloc) {
+      nalloc=(nalloc==0) ? NCHUNK : 2*nalloc;
+      s->z=(float *) realloc(s->z,sizeof(float)*nalloc*s->nchan);
+      s->mjd=(double *) realloc(s->mjd,sizeof(double)*nalloc);
+      s->length=(float *) realloc(s->length,sizeof(float)*nalloc);
+      s->zavg=(float *) realloc(s->zavg,sizeof(float)*nalloc);
+      s->zstd=(float *) realloc(s->zstd,sizeof(float)*nalloc);
+    }
+    memcpy(s->z+(long) s->nsub*s->nchan,c.z,sizeof(float)*n*c.nchan);
+    memcpy(s->mjd+s->nsub,c.mjd,sizeof(double)*n);
+    memcpy(s->length+s->nsub,c.length,sizeof(float)*n);
+    memcpy(s->zavg+s->nsub,c.zavg,sizeof(float)*n);
+    memcpy(s->zstd+s->nsub,c.zstd,sizeof(float)*n);
+    s->nsub+=n;
+  }
+  close_spectrogram(st);
+  if (s->nsub==0) {
+    rf_free(s);
+    return NULL;
+  }
+  spectrogram_limits(s);
+
+  return s;
+}
+
+void rf_free(struct spectrogram *s)
+{
+  if (s==NULL)
+    return;
+  free_spectrogram(s);
+  free(s);
+
+  return;
+}
+
+int rf_nsub(struct spectrogram *s)
+{
+  return s->nsub;
+}
+
+int rf_nchan(struct spectrogram *s)
+{
+  return s->nchan;
+}
+
+double rf_freq(struct spectrogram *s)
+{
+  return s->freq;
+}
+
+double rf_samp_rate(struct spectrogram *s)
+{
+  return s->samp_rate;
+}
+
+char *rf_start(struct spectrogram *s)
+{
+  return s->nfd0;
+}
+
+float *rf_data(struct spectrogram *s)
+{
+  return s->z;
+}
+
+double *rf_mjd(struct spectrogram *s)
+{
+  return s->mjd;
+}
+
+float *rf_length(struct spectrogram *s)
+{
+  return s->length;
+}
+
+float *rf_zavg(struct spectrogram *s)
+{
+  return s->zavg;
+}
+
+float *rf_zstd(struct spectrogram *s)
+{
+  return s->zstd;
+}
+
+// Location of a plane of 32 bit float subints stored at a fixed stride,
+// which can be mapped into memory; returns 0 for 8 bit, windowed or
+// irregular files
+int rf_map_layout(char *filename,int plane,int *nsub,int *nchan,double *freq,double *samp_rate,int64_t *offset,int64_t *stride)
+{
+  int status;
+  char header[256];
+  long size;
+  FILE *file;
+  struct binheader bh;
+  struct textheader th;
+
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return 0;
+  fseek(file,0,SEEK_END);
+  size=ftell(file);
+  rewind(file);
+
+  // Indexed files, subints in order
+  if (read_binheader(file,&bh)==1) {
+    status=(bh.nbits==-32 && bh.nwin==0 && plane>=0 && plane<bh.nplane && bh.nsub>0);
+    if (status==1) {
+      *stride=sizeof(struct subheader)+(int64_t) bh.nplane*bh.nchan*sizeof(float);
+      *offset=subint_offset(file,&bh,0);
+      status=(subint_offset(file,&bh,bh.nsub-1)==*offset+(bh.nsub-1)*(*stride));
+      *offset+=sizeof(struct subheader)+(int64_t) plane*bh.nchan*sizeof(float);
+      *nsub=bh.nsub;
+      *nchan=bh.nchan;
+      *freq=bh.freq;
+      *samp_rate=bh.samp_rate;
+    }
+    fclose(file);
+    return status;
+  }
+
+  // Headers of 256 bytes followed by the planes
+  memset(&th,0,sizeof(struct textheader));
+  status=fread(header,sizeof(char),256,file);
+  fclose(file);
+  if (status!=256 || parse_header(header,&th)==0 || th.nbits!=-32 || th.nwin>0 || plane<0 || plane>=th.nplane)
+    return 0;
+  *stride=256+(int64_t) th.nplane*th.nchan*sizeof(float);
+  *offset=256+(int64_t) plane*th.nchan*sizeof(float);
+  *nsub=size/(*stride);
+  *nchan=th.nchan;
+  *freq=th.freq;
+  *samp_rate=th.samp_rate;
+
+  return (*nsub>0);
+}
+
+// Mid times and lengths of the first nsub subints of a file that can be
+// mapped, returns the number read
+int rf_subint_times(char *filename,double *mjd,float *length,int nsub)
+{
+  int i,m,nchan,v2;
+  char header[256];
+  double freq,samp_rate;
+  int64_t offset,stride;
+  FILE *file;
+  struct binheader bh;
+  struct subheader sh;
+  struct textheader th;
+
+  if (rf_map_layout(filename,0,&m,&nchan,&freq,&samp_rate,&offset,&stride)==0)
+    return 0;
+  file=fopen(filename,"r");
+  if (file==NULL)
+    return 0;
+  memset(&th,0,sizeof(struct textheader));
+  v2=read_binheader(file,&bh);
+  offset=(v2==1) ? subint_offset(file,&bh,0) : 0;
+
+  // Subint headers
+  for (i=0;i<nsub && i<m;i++) {
+    fseek(file,offset+i*stride,SEEK_SET);
+    if (v2==1) {
+      if (fread(&sh,sizeof(struct subheader),1,file)!=1)
+	break;
+      length[i]=sh.length;
+      mjd[i]=(double) sh.tns/86400e9+0.5*sh.length/86400.0;
+    } else {
+      if (fread(header,sizeof(char),256,file)!=256 || parse_header(header,&th)==0)
+	break;
+      length[i]=th.length;
+      mjd[i]=th.mjd+0.5*th.length/86400.0;
+    }
+  }
+  fclose(file);
+
+  return i;
+}
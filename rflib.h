@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+// Stable interface of librfio for bindings; spectrograms are opaque and
+// read channel-fastest as 32 bit floats, arrays stay owned by the library
+#define RF_API_VERSION 1
+
+// Only these functions are exported when building with -fvisibility=hidden
+#define RF_EXPORT __attribute__((visibility("default")))
+
+struct spectrogram;
+
+RF_EXPORT int rf_api_version(void);
+RF_EXPORT struct spectrogram *rf_read(char *prefix,int isub,int nsub,double f0,double df0,int nbin,int fbin,int reduce,double foff,int plane);
+RF_EXPORT void rf_free(struct spectrogram *s);
+RF_EXPORT int rf_nsub(struct spectrogram *s);
+RF_EXPORT int rf_nchan(struct spectrogram *s);
+RF_EXPORT double rf_freq(struct spectrogram *s);
+RF_EXPORT double rf_samp_rate(struct spectrogram *s);
+RF_EXPORT char *rf_start(struct spectrogram *s);
+RF_EXPORT float *rf_data(struct spectrogram *s);
+RF_EXPORT double *rf_mjd(struct spectrogram *s);
+RF_EXPORT float *rf_length(struct spectrogram *s);
+RF_EXPORT float *rf_zavg(struct spectrogram *s);
+RF_EXPORT float *rf_zstd(struct spectrogram *s);
+RF_EXPORT int rf_map_layout(char *filename,int plane,int *nsub,int *nchan,double *freq,double *samp_rate,int64_t *offset,int64_t *stride);
+RF_EXPORT int rf_subint_times(char *filename,double *mjd,float *length,int nsub);
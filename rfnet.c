@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "rfnet.h"
+
+#ifndef __linux__
+// Receive one datagram per call where recvmmsg is not available
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#define MSG_WAITFORONE 0
+static int recvmmsg(int fd,struct mmsghdr *msgs,unsigned int n,int flags,void *timeout)
+{
+  ssize_t r;
+
+  r=recvmsg(fd,&msgs[0].msg_hdr,0);
+  if (r<0)
+    return -1;
+  msgs[0].msg_len=r;
+
+  return 1;
+}
+#endif
+
+#define NBATCH 64 // Datagrams per recvmmsg call
+#define MAXGAP 1024 // Maximum number of lost datagrams to zero fill
+
+// Check for udp:// or tcp:// input
+int is_netstream(char *url)
+{
+  return (strncmp(url,"udp://",6)==0 || strncmp(url,"tcp://",6)==0);
+}
+
+// Open UDP (listening on host:port) or TCP (connecting to host:port) stream
+int open_netstream(struct netstream *ns,char *url,int nhdr)
+{
+  int status,on=1,rcvbuf=8*1024*1024;
+  char host[128]="",port[16]="",*ptr;
+  struct addrinfo hints,*res;
+  ssize_t len;
+
+  // Initialize
+  memset(ns,0,sizeof(struct netstream));
+  ns->fd=-1;
+  ns->nhdr=nhdr;
+  ns->type=(strncmp(url,"udp://",6)==0) ? SOCK_DGRAM : SOCK_STREAM;
+  if (nhdr<0 || nhdr>8) {
+    fprintf(stderr,"Sequence number header of %d bytes not supported\n",nhdr);
+    return -1;
+  }
+
+  // Split host and port
+  ptr=strrchr(url+6,':');
+  if (ptr==NULL || ptr-(url+6)>=sizeof(host) || strlen(ptr+1)>=sizeof(port)) {
+    fprintf(stderr,"Failed to parse %s, expected udp://host:port or tcp://host:port\n",url);
+    return -1;
+  }
+  strncpy(host,url+6,ptr-(url+6));
+  strcpy(port,ptr+1);
+
+  // Resolve address
+  memset(&hints,0,sizeof(struct addrinfo));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=ns->type;
+  if (ns->type==SOCK_DGRAM)
+    hints.ai_flags=AI_PASSIVE;
+  status=getaddrinfo(strlen(host)>0 ? host : NULL,port,&hints,&res);
+  if (status!=0) {
+    fprintf(stderr,"Failed to resolve %s: %s\n",url,gai_strerror(status));
+    return -1;
+  }
+
+  // Open socket
+  ns->fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+  if (ns->fd<0) {
+    perror("socket");
+    freeaddrinfo(res);
+    return -1;
+  }
+  if (ns->type==SOCK_DGRAM) {
+    setsockopt(ns->fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    setsockopt(ns->fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+    setsockopt(ns->fd,SOL_SOCKET,SO_TIMESTAMP,&on,sizeof(on));
+    status=bind(ns->fd,res->ai_addr,res->ai_addrlen);
+  } else {
+    status=connect(ns->fd,res->ai_addr,res->ai_addrlen);
+  }
+  freeaddrinfo(res);
+  if (status<0) {
+    perror(url);
+    close(ns->fd);
+    ns->fd=-1;
+    return -1;
+  }
+  if (ns->type==SOCK_STREAM)
+    return 0;
+
+  // Datagram size from the first datagram
+  len=recv(ns->fd,NULL,0,MSG_PEEK|MSG_TRUNC);
+  if (len<=nhdr) {
+    fprintf(stderr,"Datagram of %ld bytes too short for a %d byte sequence number\n",(long) len,nhdr);
+    close(ns->fd);
+    ns->fd=-1;
+    return -1;
+  }
+  ns->payload=len-nhdr;
+
+  // Allocate
+  ns->pend=(char *) malloc(sizeof(char)*(NBATCH+MAXGAP)*ns->payload);
+  ns->hdr=(char *) malloc(sizeof(char)*NBATCH*8);
+  ns->ctrl=(char *) malloc(sizeof(char)*NBATCH*CMSG_SPACE(sizeof(struct timeval)));
+  ns->msgs=malloc(sizeof(struct mmsghdr)*NBATCH);
+  ns->iovs=malloc(sizeof(struct iovec)*2*NBATCH);
+
+  return 0;
+}
+
+// Sequence number and arrival time of a datagram
+static void datagram_info(struct netstream *ns,struct msghdr *mh,char *hdr,uint64_t *seq,struct timeval *tv)
+{
+  int i;
+  struct cmsghdr *cmsg;
+
+  for (i=0,*seq=0;i<ns->nhdr;i++)
+    *seq|=(uint64_t) (unsigned char) hdr[i]<<(8*i);
+
+  gettimeofday(tv,0);
+  for (cmsg=CMSG_FIRSTHDR(mh);cmsg!=NULL;cmsg=CMSG_NXTHDR(mh,cmsg))
+    if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_TIMESTAMP)
+      memcpy(tv,CMSG_DATA(cmsg),sizeof(struct timeval));
+
+  return;
+}
+
+// Number of lost datagrams before sequence number seq
+static uint64_t datagram_gap(struct netstream *ns,uint64_t seq)
+{
+  uint64_t nlost=0;
+
+  if (ns->nhdr>0 && ns->npacket>0 && seq!=ns->seq) {
+    ns->ngap++;
+    if (seq>ns->seq) {
+      nlost=seq-ns->seq;
+      ns->nlost+=nlost;
+      fprintf(stderr,"Sequence gap: expected %llu, received %llu (%llu datagrams lost)\n",(unsigned long long) ns->seq,(unsigned long long) seq,(unsigned long long) nlost);
+    } else {
+      fprintf(stderr,"Sequence reset: expected %llu, received %llu\n",(unsigned long long) ns->seq,(unsigned long long) seq);
+    }
+  }
+  ns->seq=seq+1;
+  ns->npacket++;
+
+  return nlost;
+}
+
+// Append zeros for lost datagrams to the pending buffer
+static void fill_gap(struct netstream *ns,uint64_t nlost,int nremain)
+{
+  size_t nfill,nmax;
+
+  nmax=(NBATCH+MAXGAP)*ns->payload-ns->npend-nremain*ns->payload;
+  nfill=(nlost<=MAXGAP) ? nlost*ns->payload : 0;
+  if (nfill>nmax)
+    nfill=nmax;
+  memset(ns->pend+ns->npend,0,nfill);
+  ns->npend+=nfill;
+
+  return;
+}
+
+// Read count values of size bytes, returns number of values read
+size_t read_netstream(struct netstream *ns,void *buf,size_t size,size_t count)
+{
+  int i,k,nmsg,nrecv,direct;
+  size_t n=0,m,nbytes,n0,len;
+  ssize_t r;
+  char *cbuf=(char *) buf;
+  struct mmsghdr *msgs=(struct mmsghdr *) ns->msgs;
+  struct iovec *iovs=(struct iovec *) ns->iovs;
+  uint64_t seq,nlost;
+  struct timeval tv;
+
+  nbytes=size*count;
+
+  // TCP streams are read directly
+  if (ns->type==SOCK_STREAM) {
+    while (n<nbytes) {
+      r=recv(ns->fd,cbuf+n,nbytes-n,0);
+      if (r<0 && errno==EINTR)
+	continue;
+      if (r<=0)
+	return n/size;
+      if (n==0)
+	gettimeofday(&ns->tv,0);
+      n+=r;
+    }
+    return count;
+  }
+
+  while (n<nbytes) {
+    // Deliver pending data first
+    if (ns->ipend<ns->npend) {
+      m=ns->npend-ns->ipend;
+      if (m>nbytes-n)
+	m=nbytes-n;
+      memcpy(cbuf+n,ns->pend+ns->ipend,m);
+      if (n==0)
+	ns->tv=ns->tvpend;
+      n+=m;
+      ns->ipend+=m;
+      if (ns->ipend==ns->npend)
+	ns->ipend=ns->npend=0;
+      continue;
+    }
+
+    // Receive straight into the buffer when whole datagrams fit
+    nmsg=(nbytes-n)/ns->payload;
+    if (nmsg>NBATCH)
+      nmsg=NBATCH;
+    direct=(nmsg>0);
+    if (direct==0)
+      nmsg=1;
+
+    // Set up messages
+    memset(msgs,0,sizeof(struct mmsghdr)*nmsg);
+    for (k=0;k<nmsg;k++) {
+      iovs[2*k].iov_base=ns->hdr+8*k;
+      iovs[2*k].iov_len=ns->nhdr;
+      iovs[2*k+1].iov_base=(direct==1) ? cbuf+n+k*ns->payload : ns->pend;
+      iovs[2*k+1].iov_len=ns->payload;
+      msgs[k].msg_hdr.msg_iov=(ns->nhdr>0) ? &iovs[2*k] : &iovs[2*k+1];
+      msgs[k].msg_hdr.msg_iovlen=(ns->nhdr>0) ? 2 : 1;
+      msgs[k].msg_hdr.msg_control=ns->ctrl+k*CMSG_SPACE(sizeof(struct timeval));
+      msgs[k].msg_hdr.msg_controllen=CMSG_SPACE(sizeof(struct timeval));
+    }
+
+    // Receive batch
+    nrecv=recvmmsg(ns->fd,msgs,nmsg,MSG_WAITFORONE,NULL);
+    if (nrecv<0 && errno==EINTR)
+      continue;
+    if (nrecv<=0)
+      return n/size;
+
+    // Check datagrams
+    for (k=0,n0=n;k<nrecv;k++) {
+      len=(msgs[k].msg_len>ns->nhdr) ? msgs[k].msg_len-ns->nhdr : 0;
+      datagram_info(ns,&msgs[k].msg_hdr,ns->hdr+8*k,&seq,&tv);
+      nlost=datagram_gap(ns,seq);
+      if (n==0)
+	ns->tv=tv;
+
+      // Datagram received into the pending buffer
+      if (direct==0) {
+	if (nlost>0) {
+	  memmove(ns->pend+(NBATCH+MAXGAP-1)*ns->payload,ns->pend,len);
+	  fill_gap(ns,nlost,1);
+	  memmove(ns->pend+ns->npend,ns->pend+(NBATCH+MAXGAP-1)*ns->payload,len);
+	}
+	ns->npend+=len;
+	ns->tvpend=tv;
+	break;
+      }
+
+      // Complete datagram in place
+      if (nlost==0 && len==ns->payload) {
+	n+=len;
+	continue;
+      }
+
+      // Move this and the remaining datagrams to the pending buffer
+      fill_gap(ns,nlost,nrecv-k);
+      memcpy(ns->pend+ns->npend,cbuf+n0+k*ns->payload,len);
+      ns->npend+=len;
+      ns->tvpend=tv;
+      for (i=k+1;i<nrecv;i++) {
+	len=(msgs[i].msg_len>ns->nhdr) ? msgs[i].msg_len-ns->nhdr : 0;
+	datagram_info(ns,&msgs[i].msg_hdr,ns->hdr+8*i,&seq,&tv);
+	nlost=datagram_gap(ns,seq);
+	fill_gap(ns,nlost,nrecv-i);
+	memcpy(ns->pend+ns->npend,cbuf+n0+i*ns->payload,len);
+	ns->npend+=len;
+      }
+      break;
+    }
+  }
+
+  return count;
+}
+
+// Close stream
+void close_netstream(struct netstream *ns)
+{
+  if (ns->fd>=0)
+    close(ns->fd);
+  free(ns->pend);
+  free(ns->hdr);
+  free(ns->ctrl);
+  free(ns->msgs);
+  free(ns->iovs);
+  ns->fd=-1;
+
+  return;
+}
@@ -0,0 +1,17 @@
+#include <stdint.h>
+#include <sys/time.h>
+
+struct netstream {
+  int fd,type,nhdr;
+  size_t payload;
+  uint64_t seq;
+  long npacket,ngap,nlost;
+  char *pend,*hdr,*ctrl;
+  size_t npend,ipend;
+  void *msgs,*iovs;
+  struct timeval tv,tvpend;
+};
+int is_netstream(char *url);
+int open_netstream(struct netstream *ns,char *url,int nhdr);
+size_t read_netstream(struct netstream *ns,void *buf,size_t size,size_t count);
+void close_netstream(struct netstream *ns);
@@ -11,6 +11,7 @@
 
 #define LIM 128
 #define NMAX 64
+#define NSTRIP 64 // Channels decoded per image block
 
 struct select {
   int flag,n;
@@ -21,6 +22,7 @@ struct select {
 void dec2sex(double x,char *s,int f,int len);
 void time_axis(double *mjd,int n,float xmin,float xmax,float ymin,float ymax);
 void usage(void);
+void plot_image(struct spectrogram *s,float z1,float z2,float *tr,int gray);
 void plot_traces(struct trace *t,int nsat,float fcen);
 struct trace fit_trace(struct spectrogram s,struct select sel,int site_id,int graves);
 struct trace fit_gaussian_trace(struct spectrogram s,struct select sel,int site_id,int graves);
@@ -61,7 +63,7 @@ int main(int argc,char *argv[])
   char stime[16];
   double fmin,fmax,fcen,f;
   FILE *file;
-  int arg=0,nsub=3600,nbin=1;
+  int arg=0,nsub=3600,nbin=1,fbin=1,reduce=REDUCE_MEAN,store=STORE_FLOAT,budget=PAGE_BUDGET;
   double f0=0.0,df0=0.0;
   int foverlay=1;
   struct trace *t,tf;
@@ -69,7 +71,7 @@ int main(int argc,char *argv[])
   struct select sel;
   char *env;
   int site_id=0;
-  int cmap=2;
+  int cmap=2,plane=PLANE_MEAN;
   double foff=0.0,mjdgrid=0.0;
   int jj0,jj1;
 
@@ -85,7 +87,7 @@ int main(int argc,char *argv[])
 
   // Read arguments
   if (argc>1) {
-    while ((arg=getopt(argc,argv,"p:f:w:s:l:b:z:hc:C:gm:o:"))!=-1) {
+    while ((arg=getopt(argc,argv,"p:f:w:s:l:b:F:R:z:hc:C:gm:o:P:T:B:"))!=-1) {
       switch (arg) {
 	
       case 'p':
@@ -103,6 +105,22 @@ int main(int argc,char *argv[])
       case 'b':
 	nbin=atoi(optarg);
 	break;
+
+      case 'F':
+	fbin=atoi(optarg);
+	break;
+
+      case 'R':
+	reduce=atoi(optarg);
+	break;
+
+      case 'T':
+	store=atoi(optarg);
+	break;
+
+      case 'B':
+	budget=atoi(optarg);
+	break;
 	
       case 'f':
 	f0=(double) atof(optarg);
@@ -120,6 +138,10 @@ int main(int argc,char *argv[])
 	graves=1;
 	break;
 
+      case 'P':
+	plane=atoi(optarg);
+	break;
+
       case 'h':
 	usage();
 	return 0;
@@ -153,7 +175,10 @@ int main(int argc,char *argv[])
   }
 
   // Read data
-  s=read_spectrogram(path,isub,nsub,f0,df0,nbin,foff);
+  if (store==STORE_PAGED)
+    s=page_spectrogram(path,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_TIME,budget);
+  else
+    s=read_spectrogram(path,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_TIME,store);
   
   printf("Read spectrogram\n%d channels, %d subints\nFrequency: %g MHz\nBandwidth: %g MHz\n",s.nchan,s.nsub,s.freq*1e-6,s.samp_rate*1e-6);
 
@@ -210,7 +235,7 @@ int main(int argc,char *argv[])
       cpgswin(xmin,xmax,ymin,ymax);
       
       if (cmap==3) {
-	cpggray(s.z,s.nsub,s.nchan,1,s.nsub,1,s.nchan,zmax,zmin,tr);
+	plot_image(&s,zmax,zmin,tr,1);
       } else {
 	if (cmap==0)
 	  cpgctab(cool_l,cool_r,cool_g,cool_b,9,1.0,0.5);
@@ -218,7 +243,7 @@ int main(int argc,char *argv[])
 	  cpgctab(heat_l,heat_r,heat_g,heat_b,9,1.0,0.5);
 	else if (cmap==2)
 	  cpgctab(viridis_l,viridis_r,viridis_g,viridis_b,256,1.0,0.5);
-	cpgimag(s.z,s.nsub,s.nchan,1,s.nsub,1,s.nchan,zmin,zmax,tr);
+	plot_image(&s,zmin,zmax,tr,0);
       }
 
       // Pixel axis
@@ -478,8 +503,8 @@ int main(int argc,char *argv[])
 	zzmax=0.0;
 	jmax=0;
 	for (j=j0;j<j1;j++) {
-	  if (s.z[i+s.nsub*j]>zzmax) {
-	    zzmax=s.z[i+s.nsub*j];
+	  if (ZGET(s,i,j)>zzmax) {
+	    zzmax=ZGET(s,i,j);
 	    jmax=j;
 	  }
 	}
@@ -503,8 +528,8 @@ int main(int argc,char *argv[])
 	zzmax=0.0;
 	jmax=0;
 	for (j=j0;j<j1;j++) {
-	  if (s.z[i+s.nsub*j]>zzmax) {
-	    zzmax=s.z[i+s.nsub*j];
+	  if (ZGET(s,i,j)>zzmax) {
+	    zzmax=ZGET(s,i,j);
 	    jmax=j;
 	  }
 	}
@@ -522,10 +547,10 @@ int main(int argc,char *argv[])
       f=s.freq-0.5*s.samp_rate+(double) j*s.samp_rate/(double) s.nchan;
       if (s.mjd[i]>1.0) {
 	if (graves==0)
-	  fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id);
+	  fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,ZGET(s,i,j),site_id);
 	else 
-	  fprintf(file,"%lf %lf %f %d 9999\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id);
-	printf("%lf %lf %f %d\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id);
+	  fprintf(file,"%lf %lf %f %d 9999\n",s.mjd[i],f,ZGET(s,i,j),site_id);
+	printf("%lf %lf %f %d\n",s.mjd[i],f,ZGET(s,i,j),site_id);
       }
       fclose(file);
     }
@@ -554,7 +579,7 @@ int main(int argc,char *argv[])
 	s2=0.0;
 	sn=0;
 	for (j=j0;j<j1;j++) {
-	  z=s.z[i+s.nsub*j];
+	  z=ZGET(s,i,j);
 	  if (z>zzmax) {
 	    zzmax=z;
 	    jmax=j;
@@ -718,10 +743,7 @@ int main(int argc,char *argv[])
   cpgend();
 
   // Free
-  free(s.z);
-  free(s.zavg);
-  free(s.zstd);
-  free(s.mjd);
+  free_spectrogram(&s);
   if (tf.n>0) {
     free(tf.mjd);
     free(tf.freq);
@@ -838,6 +860,32 @@ void time_axis(double *mjd,int n,float xmin,float xmax,float ymin,float ymax)
   return;
 }
 
+// Draw the image in blocks of channels, decoding compact spectrograms
+void plot_image(struct spectrogram *s,float z1,float z2,float *tr,int gray)
+{
+  int j,n;
+  float *buf=NULL,*z,trs[6];
+
+  n=(s->store==STORE_FLOAT) ? s->nchan : NSTRIP;
+  if (s->store!=STORE_FLOAT)
+    buf=(float *) malloc(sizeof(float)*s->nsub*n);
+  for (j=0;j<s->nchan;j+=n) {
+    if (j+n>s->nchan)
+      n=s->nchan-j;
+    z=channel_block(s,j,n,buf);
+    memcpy(trs,tr,sizeof(float)*6);
+    trs[0]+=tr[2]*(float) j;
+    trs[3]+=tr[5]*(float) j;
+    if (gray==1)
+      cpggray(z,s->nsub,n,1,s->nsub,1,n,z1,z2,trs);
+    else
+      cpgimag(z,s->nsub,n,1,s->nsub,1,n,z1,z2,trs);
+  }
+  free(buf);
+
+  return;
+}
+
 void usage(void)
 {
   printf("rfplot: plot RF observations\n\n");
@@ -845,6 +893,10 @@ void usage(void)
   printf("-s <start>   Number of starting subintegration [0]\n");
   printf("-l <length>  Number of subintegrations to plot [3600]\n");
   printf("-b <nbin>    Number of subintegrations to bin [1]\n");
+  printf("-F <fbin>    Number of channels to bin [1]\n");
+  printf("-R <reduce>  Channel binning: 0 mean, 1 maximum, 2 median [0]\n");
+  printf("-T <store>   Hold data as 0 float, 1 float16, 2 8-bit, 3 paged from disk [0]\n");
+  printf("-B <budget>  Memory for paged data (MB) [%d]\n",PAGE_BUDGET);
   printf("-z <zmax>    Image scaling upper limit [8.0]\n");
   printf("-f <freq>    Frequency to zoom into (Hz)\n");
   printf("-w <bw>      Bandwidth to zoom into (Hz)\n");
@@ -944,7 +996,7 @@ struct trace fit_trace(struct spectrogram s,struct select sel,int site_id,int gr
       s2=0.0;
       sn=0;
       for (j=j0;j<j1;j++) {
-	z=s.z[i+s.nsub*j];
+	z=ZGET(s,i,j);
 	s1+=z;
 	s2+=z*z;
 	sn++;
@@ -1078,7 +1130,7 @@ struct trace locate_trace(struct spectrogram s,struct trace t,int site_id,float
     s2=0.0;
     sn=0;
     for (j=j0;j<j1;j++) {
-      z=s.z[i+s.nsub*j];
+      z=ZGET(s,i,j);
       s1+=z;
       s2+=z*z;
       sn++;
@@ -1124,8 +1176,10 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
   FILE *file;
   double f;
   int *mask;
+  float *z,*buf;
 
   mask=(int *) malloc(sizeof(int)*s.nchan);
+  buf=(float *) malloc(sizeof(float)*s.nchan);
 
   // Open file
   file=fopen("filter.dat","w");
@@ -1135,6 +1189,9 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
     if (s.mjd[i]==0.0)
       continue;
 
+    // Channels of this subint
+    z=subint_span(&s,i,buf);
+
     // Set mask
     for (j=0;j<s.nchan;j++)
       mask[j]=1;
@@ -1145,7 +1202,7 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
       // Find average
       for (j=0,s1=s2=0.0;j<s.nchan;j++) {
 	if (mask[j]==1) {
-	  s1+=s.z[i+s.nsub*j];
+	  s1+=z[j];
 	  s2+=1.0;
 	}
       }
@@ -1154,7 +1211,7 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
       // Find standard deviation
       for (j=0,s1=s2=0.0;j<s.nchan;j++) {
 	if (mask[j]==1) {
-	  dz=s.z[i+s.nsub*j]-avg;
+	  dz=z[j]-avg;
 	  s1+=dz*dz;
 	  s2+=1.0;
 	}
@@ -1163,7 +1220,7 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
 
       // Update mask
       for (j=0,l=0;j<s.nchan;j++) {
-	if (fabs(s.z[i+s.nsub*j]-avg)>sigma*std) {
+	if (fabs(z[j]-avg)>sigma*std) {
 	  mask[j]=0;
 	  l++;
 	}
@@ -1171,7 +1228,7 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
     }
     // Reset mask
     for (j=0;j<s.nchan;j++) {
-      if (s.z[i+s.nsub*j]-avg>sigma*std) 
+      if (z[j]-avg>sigma*std) 
 	mask[j]=1;
       else
 	mask[j]=0;
@@ -1180,13 +1237,13 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
     // Find maximum when points are adjacent
     for (j=0;j<s.nchan-1;j++) {
       if (mask[j]==1 && mask[j+1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j+1)])
+	if (z[j]<z[j+1])
 	  mask[j]=0;
       }
     }
     for (j=s.nchan-2;j>=0;j--) {
       if (mask[j]==1 && mask[j-1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j-1)])
+	if (z[j]<z[j-1])
 	  mask[j]=0;
       }
     }
@@ -1197,9 +1254,9 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
 	f=s.freq-0.5*s.samp_rate+(double) j*s.samp_rate/(double) s.nchan;
 	if (s.mjd[i]>1.0) {
 	  if (graves==0)
-	    fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id);
+	    fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,z[j],site_id);
 	  else
-	    fprintf(file,"%lf %lf %f %d 9999 %d %d\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id,i,j);
+	    fprintf(file,"%lf %lf %f %d 9999 %d %d\n",s.mjd[i],f,z[j],site_id,i,j);
 	}
 	cpgpt1((float) i+0.5,(float) j+0.5,17);
       }
@@ -1208,6 +1265,7 @@ void filter(struct spectrogram s,int site_id,float sigma,int graves)
   fclose(file);
 
   free(mask);
+  free(buf);
 
   return;
 }
@@ -1244,7 +1302,7 @@ void peakfind(struct spectrogram s,int site_id,int i0,int i1,int j0,int j1)
 
     // Fill array
     for (j=0;j<n;j++)
-      y[j]=s.z[i+s.nsub*(j0+j)];
+      y[j]=ZGET(s,i,j0+j);
 
     // Convolve
     convolve(y,n,w,m,sy);
@@ -1266,7 +1324,7 @@ void peakfind(struct spectrogram s,int site_id,int i0,int i1,int j0,int j1)
 	x0=(float) (j+j0)+b[j]/(b[j]-b[j+1]);
 	f=s.freq-0.5*s.samp_rate+(double) x0*s.samp_rate/(double) s.nchan;
 	if (s.mjd[i]>1.0)
-	  fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,s.z[i+s.nsub*j],site_id);
+	  fprintf(file,"%lf %lf %f %d\n",s.mjd[i],f,ZGET(s,i,j),site_id);
 	cpgpt1((float) i+0.5,x0+0.5,17);
       }
     }
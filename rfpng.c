@@ -10,6 +10,7 @@
 
 #define LIM 128
 #define NMAX 64
+#define NSTRIP 64 // Channels decoded per image block
 
 struct select {
   int flag,n;
@@ -23,6 +24,7 @@ struct point {
 void dec2sex(double x,char *s,int f,int len);
 void time_axis(double *mjd,int n,float xmin,float xmax,float ymin,float ymax);
 void usage(void);
+void plot_image(struct spectrogram *s,float z1,float z2,float *tr,int gray);
 void plot_traces(struct trace *t,int nsat,float foff);
 void filter(struct spectrogram s,int site_id,float sigma,char *filename,int graves);
 
@@ -55,14 +57,14 @@ int main(int argc,char *argv[])
   char stime[16];
   double fmin,fmax,fcen,f;
   FILE *file;
-  int arg=0,nsub=1800,nbin=1;
+  int arg=0,nsub=1800,nbin=1,fbin=1,reduce=REDUCE_MEAN,store=STORE_FLOAT,budget=PAGE_BUDGET;
   double f0=0.0,df0=0.0,dy=2500;
   int foverlay=1;
   struct trace *t,tf;
   int nsat,satno;
   struct select sel;
   char *env;
-  int site_id=0,cmap=2,graves=0,create_dat=1,fname_flag=1;
+  int site_id=0,cmap=2,graves=0,create_dat=1,fname_flag=1,plane=PLANE_MEAN;
 
   // Get site
   env=getenv("ST_COSPAR");
@@ -76,7 +78,7 @@ int main(int argc,char *argv[])
 
   // Read arguments
   if (argc>1) {
-    while ((arg=getopt(argc,argv,"p:f:w:s:l:b:z:hc:C:m:gS:qo:O:"))!=-1) {
+    while ((arg=getopt(argc,argv,"p:f:w:s:l:b:F:R:z:hc:C:m:gS:qo:O:P:T:B:"))!=-1) {
       switch (arg) {
 	
       case 'p':
@@ -103,6 +105,26 @@ int main(int argc,char *argv[])
       case 'l':
 	nsub=atoi(optarg);
 	break;
+
+      case 'b':
+	nbin=atoi(optarg);
+	break;
+
+      case 'F':
+	fbin=atoi(optarg);
+	break;
+
+      case 'R':
+	reduce=atoi(optarg);
+	break;
+
+      case 'T':
+	store=atoi(optarg);
+	break;
+
+      case 'B':
+	budget=atoi(optarg);
+	break;
 	
       case 'w':
 	df0=(double) atof(optarg);
@@ -120,6 +142,10 @@ int main(int argc,char *argv[])
 	graves=1;
 	break;
 
+      case 'P':
+	plane=atoi(optarg);
+	break;
+
       case 'S':
 	sigma=atof(optarg);
 	break;
@@ -153,7 +179,10 @@ int main(int argc,char *argv[])
   }
 
   // Read data
-  s=read_spectrogram(path,isub,nsub,f0,df0,nbin,foff);
+  if (store==STORE_PAGED)
+    s=page_spectrogram(path,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_TIME,budget);
+  else
+    s=read_spectrogram(path,isub,nsub,f0,df0,nbin,fbin,reduce,foff,plane,LAYOUT_TIME,store);
   if (s.mjd[0]<54000)
     return 0;
 
@@ -188,7 +217,7 @@ int main(int argc,char *argv[])
   cpgswin(xmin,xmax,ymin,ymax);
   
   if (cmap==3) {
-    cpggray(s.z,s.nsub,s.nchan,1,s.nsub,1,s.nchan,zmax,zmin,tr);
+    plot_image(&s,zmax,zmin,tr,1);
   } else {
     if (cmap==0)
       cpgctab(cool_l,cool_r,cool_g,cool_b,9,1.0,0.5);
@@ -196,10 +225,10 @@ int main(int argc,char *argv[])
       cpgctab(heat_l,heat_r,heat_g,heat_b,9,1.0,0.5);
     else if (cmap==2)
       cpgctab(viridis_l,viridis_r,viridis_g,viridis_b,256,1.0,0.5);
-    cpgimag(s.z,s.nsub,s.nchan,1,s.nsub,1,s.nchan,zmin,zmax,tr);
+    plot_image(&s,zmin,zmax,tr,0);
   }
     
-  cpgimag(s.z,s.nsub,s.nchan,1,s.nsub,1,s.nchan,zmin,zmax,tr);
+  plot_image(&s,zmin,zmax,tr,0);
     
   // Pixel axis
   cpgbox("CTSM1",0.,0,"CTSM1",0.,0);
@@ -246,8 +275,7 @@ int main(int argc,char *argv[])
   cpgend();
   
   // Free
-  free(s.z);
-  free(s.mjd);
+  free_spectrogram(&s);
   
   for (i=0;i<nsat;i++) {
     free(t[i].mjd);
@@ -366,6 +394,32 @@ void time_axis(double *mjd,int n,float xmin,float xmax,float ymin,float ymax)
   return;
 }
 
+// Draw the image in blocks of channels, decoding compact spectrograms
+void plot_image(struct spectrogram *s,float z1,float z2,float *tr,int gray)
+{
+  int j,n;
+  float *buf=NULL,*z,trs[6];
+
+  n=(s->store==STORE_FLOAT) ? s->nchan : NSTRIP;
+  if (s->store!=STORE_FLOAT)
+    buf=(float *) malloc(sizeof(float)*s->nsub*n);
+  for (j=0;j<s->nchan;j+=n) {
+    if (j+n>s->nchan)
+      n=s->nchan-j;
+    z=channel_block(s,j,n,buf);
+    memcpy(trs,tr,sizeof(float)*6);
+    trs[0]+=tr[2]*(float) j;
+    trs[3]+=tr[5]*(float) j;
+    if (gray==1)
+      cpggray(z,s->nsub,n,1,s->nsub,1,n,z1,z2,trs);
+    else
+      cpgimag(z,s->nsub,n,1,s->nsub,1,n,z1,z2,trs);
+  }
+  free(buf);
+
+  return;
+}
+
 void usage(void)
 {
   printf("rfplot: plot RF observations\n\n");
@@ -373,10 +427,15 @@ void usage(void)
   printf("-s <start>   Number of starting subintegration [0]\n");
   printf("-l <length>  Number of subintegrations to plot [3600]\n");
   printf("-b <nbin>    Number of subintegrations to bin [1]\n");
+  printf("-F <fbin>    Number of channels to bin [1]\n");
+  printf("-R <reduce>  Channel binning: 0 mean, 1 maximum, 2 median [0]\n");
+  printf("-T <store>   Hold data as 0 float, 1 float16, 2 8-bit, 3 paged from disk [0]\n");
+  printf("-B <budget>  Memory for paged data (MB) [%d]\n",PAGE_BUDGET);
   printf("-z <zmax>    Image scaling upper limit [8.0]\n");
   printf("-f <freq>    Frequency to zoom into (Hz)\n");
   printf("-w <bw>      Bandwidth to zoom into (Hz)\n");
   printf("-O <offset>  Frequency offset to apply (Hz) [0]\n");
+  printf("-P <plane>   Plane to read: 0 mean, 1 maximum, 2 variance [0]\n");
   printf("-h           This help\n");
 
   return;
@@ -435,16 +494,20 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
   FILE *file;
   double f;
   int *mask;
-  float *sig;
+  float *sig,*z,*buf;
 
   mask=(int *) malloc(sizeof(int)*s.nchan);
   sig=(float *) malloc(sizeof(float)*s.nchan);
+  buf=(float *) malloc(sizeof(float)*s.nchan);
   
   // Open file
   file=fopen(filename,"w");
 
   // Loop over subints
   for (i=0;i<s.nsub;i++) {
+    // Channels of this subint
+    z=subint_span(&s,i,buf);
+
     // Set mask
     for (j=0;j<s.nchan;j++)
       mask[j]=1;
@@ -455,7 +518,7 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
       // Find average
       for (j=0,s1=s2=0.0;j<s.nchan;j++) {
 	if (mask[j]==1) {
-	  s1+=s.z[i+s.nsub*j];
+	  s1+=z[j];
 	  s2+=1.0;
 	}
       }
@@ -464,7 +527,7 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
       // Find standard deviation
       for (j=0,s1=s2=0.0;j<s.nchan;j++) {
 	if (mask[j]==1) {
-	  dz=s.z[i+s.nsub*j]-avg;
+	  dz=z[j]-avg;
 	  s1+=dz*dz;
 	  s2+=1.0;
 	}
@@ -473,7 +536,7 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
 
       // Update mask
       for (j=0,l=0;j<s.nchan;j++) {
-	if (fabs(s.z[i+s.nsub*j]-avg)>sigma*std) {
+	if (fabs(z[j]-avg)>sigma*std) {
 	  mask[j]=0;
 	  l++;
 	}
@@ -481,7 +544,7 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
     }
        // Reset mask
     for (j=0;j<s.nchan;j++) {
-      sig[j]=(s.z[i+s.nsub*j]-avg)/std;
+      sig[j]=(z[j]-avg)/std;
       if (sig[j]>sigma) 
 	mask[j]=1;
       else
@@ -491,13 +554,13 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
     // Find maximum when points are adjacent
     for (j=0;j<s.nchan-1;j++) {
       if (mask[j]==1 && mask[j+1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j+1)])
+	if (z[j]<z[j+1])
 	  mask[j]=0;
       }
     }
     for (j=s.nchan-2;j>=0;j--) {
       if (mask[j]==1 && mask[j-1]==1) {
-	if (s.z[i+s.nsub*j]<s.z[i+s.nsub*(j-1)])
+	if (z[j]<z[j-1])
 	  mask[j]=0;
       }
     }
@@ -521,6 +584,7 @@ void filter(struct spectrogram s,int site_id,float sigma,char *filename,int grav
 
   free(mask);
   free(sig);
+  free(buf);
 
   return;
 }
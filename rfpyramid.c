@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "rftime.h"
+#include "rfio.h"
+
+void usage(void)
+{
+  printf("rfpyramid: Write reduced resolution sidecars for fast overviews\n\n");
+  printf("-p <prefix>     Input filename prefix\n");
+  printf("-s <start>      Number of starting file [0]\n");
+  printf("-l <number>     Number of files to reduce [all]\n");
+  printf("-n <levels>     Number of levels, each halving time and frequency resolution [6]\n");
+  printf("-h              This help\n");
+
+  return;
+}
+
+// Halve time and frequency resolution of channel-fastest mean and maximum
+// planes in place; returns the number of subints left
+int reduce(float *zm,float *zx,double *mjd,float *length,int nsub,int nchan)
+{
+  int i,j,k,a,b;
+  long l;
+  float sm,sx;
+
+  for (i=0;i<(nsub+1)/2;i++) {
+    k=(2*i+1<nsub) ? 2 : 1;
+    for (j=0;j<nchan/2;j++) {
+      for (a=0,sm=0.0,sx=-INFINITY;a<k;a++) {
+	for (b=0;b<2;b++) {
+	  l=(long) (2*i+a)*nchan+2*j+b;
+	  sm+=zm[l];
+	  if (zx[l]>sx)
+	    sx=zx[l];
+	}
+      }
+      zm[(long) i*nchan/2+j]=sm/(float) (2*k);
+      zx[(long) i*nchan/2+j]=sx;
+    }
+    mjd[i]=(k==2) ? 0.5*(mjd[2*i]+mjd[2*i+1]) : mjd[2*i];
+    length[i]=(k==2) ? length[2*i]+length[2*i+1] : length[2*i];
+  }
+
+  return (nsub+1)/2;
+}
+
+// Write one file of a pyramid level
+void write_level(char *prefix,int level,int k,float *zm,float *zx,double *mjd,float *length,int nsub,int nchan,double freq,double samp_rate)
+{
+  int i;
+  char lprefix[256],filename[300],header[256],nfd[32];
+  FILE *file;
+
+  // Open file
+  sprintf(lprefix,PYRAMID_FORMAT,prefix,level);
+  sprintf(filename,"%s_%06d.bin",lprefix,k);
+  file=fopen(filename,"w");
+  if (file==NULL) {
+    fprintf(stderr,"Failed to open %s\n",filename);
+    return;
+  }
+
+  // Loop over subints
+  for (i=0;i<nsub;i++) {
+    // Start time, rounded to the nearest millisecond
+    memset(header,0,sizeof(header));
+    mjd2nfd(mjd[i]-0.5*length[i]/86400.0+0.0005/86400.0,nfd);
+    sprintf(header,"HEADER\nUTC_START    %s\nFREQ         %lf Hz\nBW           %lf Hz\nLENGTH       %f s\nNCHAN        %d\nNSUB         %d\nNPLANE       2\nEND\n",nfd,freq,samp_rate,length[i],nchan,nsub);
+
+    // Mean and maximum planes
+    fwrite(header,sizeof(char),256,file);
+    fwrite(zm+(long) i*nchan,sizeof(float),nchan,file);
+    fwrite(zx+(long) i*nchan,sizeof(float),nchan,file);
+  }
+
+  // Close file
+  fclose(file);
+
+  return;
+}
+
+int main(int argc,char *argv[])
+{
+  int k,arg=0,isub=0,nfile=0,nlevel=6,level,nsub,nchan;
+  char prefix[128]="",filename[256];
+  float *zm,*zx,*length;
+  double *mjd;
+  struct specstream *st0,*st1;
+  struct spectrogram s0,s1;
+  struct fileinfo f;
+  struct stat sb;
+
+  // Read arguments
+  if (argc>1) {
+    while ((arg=getopt(argc,argv,"p:s:l:n:h"))!=-1) {
+      switch(arg) {
+
+      case 'p':
+	strcpy(prefix,optarg);
+	break;
+
+      case 's':
+	isub=atoi(optarg);
+	break;
+
+      case 'l':
+	nfile=atoi(optarg);
+	break;
+
+      case 'n':
+	nlevel=atoi(optarg);
+	break;
+
+      case 'h':
+	usage();
+	return 0;
+
+      default:
+	usage();
+	return 0;
+      }
+    }
+  } else {
+    usage();
+    return 0;
+  }
+  if (nlevel<1 || nlevel>NLEVEL) {
+    fprintf(stderr,"Number of levels should be between 1 and %d\n",NLEVEL);
+    return -1;
+  }
+
+  // Reduce each file on its own, so levels stay aligned with the files
+  for (k=isub;nfile==0 || k<isub+nfile;k++) {
+    // Complete subints of the file
+    sprintf(filename,"%s_%06d.bin",prefix,k);
+    memset(&f,0,sizeof(struct fileinfo));
+    f.name=filename;
+    if (stat(filename,&sb)==0) {
+      f.size=sb.st_size;
+      sample_file(&f);
+    }
+    if (f.status==0 && k==isub) {
+      fprintf(stderr,"Failed to read %s\n",filename);
+      return -1;
+    } else if (f.status==0) {
+      break;
+    }
+
+    // Read the file in one chunk, with the maximum plane if present
+    st0=open_spectrogram(prefix,k,f.nsub,0.0,0.0,1,1,REDUCE_MEAN,0.0,PLANE_MEAN,LAYOUT_CHAN,f.nsub);
+    st1=(st0!=NULL && f.nplane>PLANE_MAX) ? open_spectrogram(prefix,k,f.nsub,0.0,0.0,1,1,REDUCE_MEAN,0.0,PLANE_MAX,LAYOUT_CHAN,f.nsub) : NULL;
+    if (st0==NULL || (f.nplane>PLANE_MAX && st1==NULL)) {
+      if (st0!=NULL)
+	close_spectrogram(st0);
+      break;
+    }
+    nsub=next_chunk(st0,&s0);
+
+    // Allocate
+    zm=(float *) malloc(sizeof(float)*nsub*s0.nchan);
+    zx=(float *) malloc(sizeof(float)*nsub*s0.nchan);
+    mjd=(double *) malloc(sizeof(double)*nsub);
+    length=(float *) malloc(sizeof(float)*nsub);
+
+    // Maxima of the full resolution maximum plane, otherwise of the mean
+    memcpy(zm,s0.z,sizeof(float)*nsub*s0.nchan);
+    if (st1!=NULL && next_chunk(st1,&s1)==nsub)
+      memcpy(zx,s1.z,sizeof(float)*nsub*s0.nchan);
+    else
+      memcpy(zx,s0.z,sizeof(float)*nsub*s0.nchan);
+    memcpy(mjd,s0.mjd,sizeof(double)*nsub);
+    memcpy(length,s0.length,sizeof(float)*nsub);
+
+    // Halve resolution per level
+    for (level=1,nchan=s0.nchan;nsub>0 && level<=nlevel && nchan%2==0;level++) {
+      nsub=reduce(zm,zx,mjd,length,nsub,nchan);
+      nchan/=2;
+      write_level(prefix,level,k,zm,zx,mjd,length,nsub,nchan,s0.freq,s0.samp_rate);
+    }
+    printf("%s_%06d.bin: %d levels\n",prefix,k,level-1);
+
+    // Close
+    close_spectrogram(st0);
+    if (st1!=NULL)
+      close_spectrogram(st1);
+
+    // Free
+    free(zm);
+    free(zx);
+    free(mjd);
+    free(length);
+  }
+
+  return 0;
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "rftime.h"
+#include "rfio.h"
+
+#define NTHREAD 4 // Matches streamed at once, each with its own prefetching
+#define NCHUNK 256 // Subints per chunk
+
+// Run of consecutive files of a series covering the query
+struct match {
+  char *prefix,outprefix[300];
+  int k,nsub,skip,nchan,nbits,version,nout;
+  double mjd0,mjd1,freq,samp_rate;
+};
+
+// Query and matches shared by the streaming threads
+struct query {
+  struct match *m;
+  int n,next,nbin,nbits,version;
+  double t0,t1,f0,df0;
+  pthread_mutex_t lock;
+};
+
+void usage(void)
+{
+  printf("rfquery: Find spectrograms in an archive index\n\n");
+  printf("-i <index>   Index file written by rfindex [%s]\n",INDEX_NAME);
+  printf("-s <start>   Start time (YYYY-MM-DDTHH:MM:SS) [all]\n");
+  printf("-e <end>     End time (YYYY-MM-DDTHH:MM:SS)\n");
+  printf("-d <length>  Length of the time window (s) [600]\n");
+  printf("-f <freq>    Frequency to look for (Hz) [all]\n");
+  printf("-w <bw>      Bandwidth around it to look for, and zoom into when writing (Hz) [0]\n");
+  printf("-O <file>    Write the matching data to this prefix\n");
+  printf("-b <nbin>    Number of subintegrations to bin when writing [1]\n");
+  printf("-B <bits>    Output bits per value, 8 or 32 [as input]\n");
+  printf("-V <version> Output format, 1 for 256 byte headers, 2 for indexed files [as input]\n");
+  printf("-h           This help\n\n");
+  printf("Each match is listed as prefix, first file, number of subints from\n");
+  printf("the start of that file (for rfplot -s/-l), subints to skip before the\n");
+  printf("window, start and end time, frequency (MHz), bandwidth (MHz) and channels.\n");
+  printf("With -O several matches are written to <file>.1, <file>.2, etc.\n");
+
+  return;
+}
+
+// Whether an index entry covers the query
+int covers(struct indexentry *e,double t0,double t1,double f0,double df0)
+{
+  if (e->version==0 || e->nsub<=0 || e->mjd1<=t0 || e->mjd0>=t1)
+    return 0;
+  if (f0>0.0 && (e->freq+0.5*e->samp_rate<f0-0.5*df0 || e->freq-0.5*e->samp_rate>f0+0.5*df0))
+    return 0;
+
+  return 1;
+}
+
+// Subint of an entry at time mjd, from its first subint and length
+int subint_at(struct indexentry *e,double mjd)
+{
+  double x;
+
+  // Allow for times rounded in the headers
+  x=(e->length>0.0) ? floor((mjd-e->mjd0)*86400.0/e->length+1e-3) : 0.0;
+  if (x<0.0)
+    x=0.0;
+  if (x>e->nsub)
+    x=e->nsub;
+
+  return (int) x;
+}
+
+// Stream the window of a match into new files
+void write_match(struct query *q,struct match *m)
+{
+  int i,i0,nbits,version;
+  struct spectrogram s,t;
+  struct specstream *st;
+  struct specwriter *w;
+
+  st=open_spectrogram(m->prefix,m->k,m->nsub,q->f0,q->df0,q->nbin,1,REDUCE_MEAN,0.0,PLANE_MEAN,LAYOUT_CHAN,NCHUNK);
+  if (st==NULL)
+    return;
+  nbits=(q->nbits!=0) ? q->nbits : ((m->nbits==8) ? 8 : -32);
+  version=(q->version!=0) ? q->version : m->version;
+  w=open_writer(m->outprefix,(m->nsub-m->skip)/q->nbin+1,nbits,version);
+
+  // Subints inside the window
+  while (next_chunk(st,&s)>0) {
+    for (i=0;i<s.nsub && s.mjd[i]<q->t0;i++);
+    for (i0=i;i<s.nsub && s.mjd[i]<=q->t1;i++);
+    if (i==i0)
+      continue;
+    t=s;
+    t.nsub=i-i0;
+    t.z=s.z+(long) i0*s.nchan;
+    t.mjd=s.mjd+i0;
+    t.length=s.length+i0;
+    t.zavg=s.zavg+i0;
+    t.zstd=s.zstd+i0;
+    if (write_chunk(w,t)<0)
+      break;
+    m->nout+=t.nsub;
+  }
+
+  close_writer(w);
+  close_spectrogram(st);
+
+  return;
+}
+
+void *write_thread(void *arg)
+{
+  int i;
+  struct query *q=(struct query *) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    i=q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i>=q->n)
+      break;
+    write_match(q,&q->m[i]);
+  }
+
+  return NULL;
+}
+
+int main(int argc,char *argv[])
+{
+  int i,j,l,arg=0,n=0,nthread;
+  char indexname[1024]=INDEX_NAME,outprefix[256]="",nfd0[32],nfd1[32];
+  double length=600.0;
+  struct archive a;
+  struct indexentry *e;
+  struct match *m;
+  struct query q;
+  pthread_t thread[NTHREAD];
+
+  memset(&q,0,sizeof(struct query));
+  q.t0=-1.0;
+  q.t1=-1.0;
+  q.nbin=1;
+
+  // Read arguments
+  while ((arg=getopt(argc,argv,"i:s:e:d:f:w:O:b:B:V:h"))!=-1) {
+    switch (arg) {
+
+    case 'i':
+      strcpy(indexname,optarg);
+      break;
+
+    case 's':
+      q.t0=nfd2mjd(optarg);
+      break;
+
+    case 'e':
+      q.t1=nfd2mjd(optarg);
+      break;
+
+    case 'd':
+      length=atof(optarg);
+      break;
+
+    case 'f':
+      q.f0=(double) atof(optarg);
+      break;
+
+    case 'w':
+      q.df0=(double) atof(optarg);
+      break;
+
+    case 'O':
+      strcpy(outprefix,optarg);
+      break;
+
+    case 'b':
+      q.nbin=atoi(optarg);
+      if (q.nbin<1)
+	q.nbin=1;
+      break;
+
+    case 'B':
+      q.nbits=(atoi(optarg)==8) ? 8 : -32;
+      break;
+
+    case 'V':
+      q.version=atoi(optarg);
+      if (q.version!=1 && q.version!=2) {
+	fprintf(stderr,"Output format version %d not supported\n",q.version);
+	return -1;
+      }
+      break;
+
+    case 'h':
+      usage();
+      return 0;
+
+    default:
+      usage();
+      return 0;
+    }
+  }
+
+  // Time window
+  if (q.t0<0.0) {
+    q.t0=0.0;
+    q.t1=1e9;
+  } else if (q.t1<0.0) {
+    q.t1=q.t0+length/86400.0;
+  }
+
+  // Read index
+  if (read_archive(indexname,&a)==0) {
+    fprintf(stderr,"Failed to read index %s\n",indexname);
+    return -1;
+  }
+
+  // Runs of consecutive covering files with the same layout
+  m=(struct match *) malloc(sizeof(struct match)*(a.nfile+1));
+  for (i=0;i<a.nfile;i=j) {
+    if (covers(&a.e[i],q.t0,q.t1,q.f0,q.df0)==0) {
+      j=i+1;
+      continue;
+    }
+    for (j=i+1;j<a.nfile && a.e[j].series==a.e[i].series && a.e[j].k==a.e[j-1].k+1 && a.e[j].nchan==a.e[i].nchan && a.e[j].freq==a.e[i].freq && a.e[j].samp_rate==a.e[i].samp_rate && covers(&a.e[j],q.t0,q.t1,q.f0,q.df0)==1;j++);
+
+    memset(&m[n],0,sizeof(struct match));
+    e=&a.e[i];
+    m[n].prefix=a.prefix[e->series];
+    m[n].k=e->k;
+    m[n].skip=subint_at(e,q.t0);
+    m[n].nchan=e->nchan;
+    m[n].nbits=e->nbits;
+    m[n].version=e->version;
+    m[n].freq=e->freq;
+    m[n].samp_rate=e->samp_rate;
+    m[n].mjd0=(e->mjd0>q.t0) ? e->mjd0 : q.t0;
+    for (l=i;l<j-1;l++)
+      m[n].nsub+=a.e[l].nsub;
+    e=&a.e[j-1];
+    m[n].nsub+=(subint_at(e,q.t1)<e->nsub) ? subint_at(e,q.t1)+1 : e->nsub;
+    m[n].mjd1=(e->mjd1<q.t1) ? e->mjd1 : q.t1;
+    n++;
+  }
+
+  // List matches
+  for (i=0;i<n;i++) {
+    mjd2nfd(m[i].mjd0,nfd0);
+    mjd2nfd(m[i].mjd1,nfd1);
+    printf("%s %06d %d %d %s %s %8.3lf %8.3lf %d\n",m[i].prefix,m[i].k,m[i].nsub,m[i].skip,nfd0,nfd1,m[i].freq*1e-6,m[i].samp_rate*1e-6,m[i].nchan);
+  }
+
+  // Stream matches in parallel
+  fflush(stdout);
+  if (strlen(outprefix)>0 && n>0) {
+    for (i=0;i<n;i++) {
+      if (n==1)
+	strcpy(m[i].outprefix,outprefix);
+      else
+	sprintf(m[i].outprefix,"%s.%d",outprefix,i+1);
+    }
+    q.m=m;
+    q.n=n;
+    q.next=0;
+    nthread=(n<NTHREAD) ? n : NTHREAD;
+    pthread_mutex_init(&q.lock,NULL);
+    for (i=0;i<nthread;i++)
+      pthread_create(&thread[i],NULL,write_thread,&q);
+    for (i=0;i<nthread;i++)
+      pthread_join(thread[i],NULL);
+    pthread_mutex_destroy(&q.lock);
+    for (i=0;i<n;i++)
+      fprintf(stderr,"wrote %s (%d subints)\n",m[i].outprefix,m[i].nout);
+  }
+
+  // Free
+  free(m);
+  free_archive(&a);
+
+  return (n>0) ? 0 : 1;
+}